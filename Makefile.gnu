@@ -7,7 +7,7 @@ HDRS=		opensmtpd.h
 MAN=		osmtpd_run.3
 LIBDIR?=	${LOCALBASE}/lib/
 MANDIR?=	${LOCALBASE}/share/man/man3
-LDLIBS+=	-levent
+LDLIBS+=	-levent -lpthread
 
 mkfile_path := ${abspath ${lastword ${MAKEFILE_LIST}}}
 CURDIR := ${dir ${mkfile_path}}
@@ -49,6 +49,12 @@ NEED_STRTONUM?=		1
 
 MANFORMAT?=		mangz
 
+# Set to 0 to drop support for filter protocol versions before 0.6
+LEGACY_PROTOCOL?=	1
+
+# Set to 1 to use io_uring on Linux when the kernel supports it
+IO_URING?=		0
+
 INSTALL?=	install
 LINK?=		ln
 
@@ -122,6 +128,13 @@ strtonum.o: ${CURDIR}/openbsd-compat/strtonum.c
 	${CC} ${CFLAGS} -c -o strtonum.o ${CURDIR}/openbsd-compat/strtonum.c
 endif
 
+ifeq (${LEGACY_PROTOCOL}, 0)
+CFLAGS+=	-DNO_LEGACY_PROTOCOL=1
+endif
+ifeq (${IO_URING}, 1)
+CFLAGS+=	-DIO_URING=1
+endif
+
 OBJS=		${notdir ${SRCS:.c=.o}}
 
 ifdef VERSION_SCRIPT
@@ -143,7 +156,18 @@ install: includes ${TARGET_LIB} ${TARGET_MAN}
 	${LINK} -s ${TARGET_LIB} ${DESTDIR}${LIBDIR}/${BASE_LIB}
 	${INSTALL} -D -o ${MANOWN} -g ${MANGRP} -m ${MANPERM} ${TARGET_MAN} ${DESTDIR}${MANDIR}/${TARGET_MAN}
 
-CLEANFILES+=	*.o ${TARGET_LIB}
+# Session table against the red-black tree it replaced: make bench
+BENCH=		bench/sessions
+
+${BENCH}: ${CURDIR}/bench/sessions.c ${SRCS} ${HDRS}
+	${CC} ${CFLAGS} -O2 -o $@ ${CURDIR}/bench/sessions.c \
+	    ${filter-out opensmtpd.c,${SRCS}} ${LDLIBS}
+
+.PHONY: bench
+bench: ${BENCH}
+	./${BENCH}
+
+CLEANFILES+=	*.o ${TARGET_LIB} ${BENCH}
 
 .PHONY: clean
 clean:
@@ -0,0 +1,199 @@
+/*
+ * Time insert, lookup and remove of sessions by reqid in the hash table of
+ * opensmtpd.c against the red-black tree it replaced. The library is
+ * included directly, so the static table functions are the ones that ship.
+ *
+ * Lookups are timed twice: with every reqid in random order, and in runs of
+ * consecutive lookups for the same reqid, as data-lines arrive, which the
+ * one entry cache of the table serves.
+ */
+#include "opensmtpd.c"
+
+#include <sys/tree.h>
+
+#define BENCH_ROUNDS(n) ((2000000 / (n)) + 1)
+#define BENCH_RUN 16
+
+struct rbsession {
+	RB_ENTRY(rbsession) entry;
+	struct osmtpd_session session;
+};
+
+static int rbsession_cmp(struct rbsession *, struct rbsession *);
+RB_HEAD(rbsessions, rbsession) rbsessions = RB_INITIALIZER(NULL);
+RB_PROTOTYPE_STATIC(rbsessions, rbsession, entry, rbsession_cmp);
+
+static uint64_t bench_rand(void);
+static void bench_shuffle(size_t *, size_t);
+static uint64_t bench_ns(void);
+static void bench(size_t);
+
+static uint64_t seed = 0x2545f4914f6cdd1dULL;
+/* Keeps the lookups from being optimized away */
+static volatile uintptr_t sink;
+
+int
+main(void)
+{
+	static const size_t counts[] = { 1000, 20000, 100000 };
+	size_t i;
+
+	printf("%-9s %-12s %12s %12s\n", "sessions", "op", "rbtree ns",
+	    "hash ns");
+	for (i = 0; i < NITEMS(counts); i++)
+		bench(counts[i]);
+	return 0;
+}
+
+static void
+bench(size_t n)
+{
+	struct rbsession *nodes, search, *node;
+	struct osmtpd_session *session;
+	size_t *order, rounds, round, i, j;
+	uint64_t rb[5] = { 0 }, ht[5] = { 0 }, start;
+	const char *ops[5] = {
+		"insert", "lookup", "lookup-run", "remove", "miss"
+	};
+
+	if ((nodes = calloc(n, sizeof(*nodes))) == NULL ||
+	    (order = calloc(n, sizeof(*order))) == NULL)
+		osmtpd_err(1, NULL);
+	for (i = 0; i < n; i++) {
+		nodes[i].session.ctx.reqid = bench_rand();
+		order[i] = i;
+	}
+
+	rounds = BENCH_ROUNDS(n);
+	for (round = 0; round < rounds; round++) {
+		bench_shuffle(order, n);
+
+		start = bench_ns();
+		for (i = 0; i < n; i++)
+			RB_INSERT(rbsessions, &rbsessions, &nodes[order[i]]);
+		rb[0] += bench_ns() - start;
+		start = bench_ns();
+		for (i = 0; i < n; i++)
+			osmtpd_session_insert(&(nodes[order[i]].session));
+		ht[0] += bench_ns() - start;
+
+		bench_shuffle(order, n);
+		start = bench_ns();
+		for (i = 0; i < n; i++) {
+			search.session.ctx.reqid =
+			    nodes[order[i]].session.ctx.reqid;
+			sink = (uintptr_t)RB_FIND(rbsessions, &rbsessions,
+			    &search);
+		}
+		rb[1] += bench_ns() - start;
+		start = bench_ns();
+		for (i = 0; i < n; i++)
+			sink = (uintptr_t)osmtpd_session_find(
+			    nodes[order[i]].session.ctx.reqid);
+		ht[1] += bench_ns() - start;
+
+		start = bench_ns();
+		for (i = 0; i < n; i += BENCH_RUN) {
+			search.session.ctx.reqid =
+			    nodes[order[i]].session.ctx.reqid;
+			for (j = 0; j < BENCH_RUN; j++)
+				sink = (uintptr_t)RB_FIND(rbsessions,
+				    &rbsessions, &search);
+		}
+		rb[2] += bench_ns() - start;
+		start = bench_ns();
+		for (i = 0; i < n; i += BENCH_RUN) {
+			for (j = 0; j < BENCH_RUN; j++)
+				sink = (uintptr_t)osmtpd_session_find(
+				    nodes[order[i]].session.ctx.reqid);
+		}
+		ht[2] += bench_ns() - start;
+
+		bench_shuffle(order, n);
+		start = bench_ns();
+		for (i = 0; i < n; i++)
+			RB_REMOVE(rbsessions, &rbsessions, &nodes[order[i]]);
+		rb[3] += bench_ns() - start;
+		start = bench_ns();
+		for (i = 0; i < n; i++)
+			sink = (uintptr_t)osmtpd_session_remove(
+			    nodes[order[i]].session.ctx.reqid);
+		ht[3] += bench_ns() - start;
+
+		/* Unknown reqids, as for the first event of a session */
+		for (i = 0; i < n; i++)
+			RB_INSERT(rbsessions, &rbsessions, &nodes[i]);
+		for (i = 0; i < n; i++)
+			osmtpd_session_insert(&(nodes[i].session));
+		start = bench_ns();
+		for (i = 0; i < n; i++) {
+			search.session.ctx.reqid = bench_rand();
+			sink = (uintptr_t)RB_FIND(rbsessions, &rbsessions,
+			    &search);
+		}
+		rb[4] += bench_ns() - start;
+		start = bench_ns();
+		for (i = 0; i < n; i++)
+			sink = (uintptr_t)osmtpd_session_find(bench_rand());
+		ht[4] += bench_ns() - start;
+		while ((node = RB_MIN(rbsessions, &rbsessions)) != NULL)
+			RB_REMOVE(rbsessions, &rbsessions, node);
+		for (i = 0; i < n; i++) {
+			session = osmtpd_session_remove(
+			    nodes[i].session.ctx.reqid);
+			if (session != &(nodes[i].session))
+				osmtpd_errx(1, "Session %zu not found", i);
+		}
+	}
+
+	for (i = 0; i < NITEMS(ops); i++)
+		printf("%-9zu %-12s %12.1f %12.1f\n", n, ops[i],
+		    (double)rb[i] / (n * rounds),
+		    (double)ht[i] / (n * rounds));
+	free(order);
+	free(nodes);
+}
+
+/* splitmix64, reqids are random 64 bit values */
+static uint64_t
+bench_rand(void)
+{
+	uint64_t z;
+
+	z = (seed += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void
+bench_shuffle(size_t *order, size_t n)
+{
+	size_t i, j, tmp;
+
+	for (i = n - 1; i > 0; i--) {
+		j = bench_rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static uint64_t
+bench_ns(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		osmtpd_err(1, "clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+rbsession_cmp(struct rbsession *a, struct rbsession *b)
+{
+	return a->session.ctx.reqid < b->session.ctx.reqid ? -1 :
+	    a->session.ctx.reqid > b->session.ctx.reqid;
+}
+
+RB_GENERATE_STATIC(rbsessions, rbsession, entry, rbsession_cmp);
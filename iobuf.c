@@ -40,9 +40,10 @@
 
 #define IOBUF_MAX	65536
 #define IOBUFQ_MIN	4096
+#define IOBUFQ_MAXFREE	8
 
 struct ioqbuf	*ioqbuf_alloc(struct iobuf *, size_t);
-void		 iobuf_drain(struct iobuf *, size_t);
+void		 ioqbuf_free(struct iobuf *, struct ioqbuf *);
 
 int
 iobuf_init(struct iobuf *io, size_t size, size_t max)
@@ -63,6 +64,8 @@ iobuf_init(struct iobuf *io, size_t size, size_t max)
 
 	io->size = size;
 	io->max = max;
+	io->qsize = IOBUFQ_MIN;
+	io->qmaxfree = IOBUFQ_MAXFREE;
 
 	return (0);
 }
@@ -79,6 +82,11 @@ iobuf_clear(struct iobuf *io)
 		free(q);
 	}
 
+	while ((q = io->qfree)) {
+		io->qfree = q->next;
+		free(q);
+	}
+
 	memset(io, 0, sizeof (*io));
 }
 
@@ -95,7 +103,7 @@ iobuf_drain(struct iobuf *io, size_t n)
 		} else {
 			left -= q->wpos - q->rpos;
 			io->outq = q->next;
-			free(q);
+			ioqbuf_free(io, q);
 		}
 	}
 
@@ -125,6 +133,49 @@ iobuf_extend(struct iobuf *io, size_t n)
 	return (0);
 }
 
+/*
+ * Double the buffer, up to io->max.  Unlike iobuf_extend(), the new space
+ * is not cleared, as nothing past wpos is ever looked at.
+ */
+int
+iobuf_grow(struct iobuf *io)
+{
+	size_t	 size;
+	char	*t;
+
+	if (io->size >= io->max)
+		return (-1);
+
+	size = io->size > io->max / 2 ? io->max : io->size * 2;
+	if ((t = realloc(io->buf, size)) == NULL)
+		return (-1);
+
+	io->size = size;
+	io->buf = t;
+
+	return (0);
+}
+
+/* Set a new size and maximum, the buffered data must fit in size. */
+int
+iobuf_resize(struct iobuf *io, size_t size, size_t max)
+{
+	char	*t;
+
+	if (size == 0 || size > max || iobuf_len(io) > size)
+		return (-1);
+
+	iobuf_normalize(io);
+	if ((t = realloc(io->buf, size)) == NULL)
+		return (-1);
+
+	io->size = size;
+	io->max = max;
+	io->buf = t;
+
+	return (0);
+}
+
 size_t
 iobuf_left(struct iobuf *io)
 {
@@ -154,39 +205,121 @@ iobuf_drop(struct iobuf *io, size_t n)
 {
 	if (n >= iobuf_len(io)) {
 		io->rpos = io->wpos = 0;
+		io->scan = 0;
 		return;
 	}
 
 	io->rpos += n;
+	io->scan = n >= io->scan ? 0 : io->scan - n;
+}
+
+/*
+ * Find the next newline in the buffered data.  The part of the buffer that
+ * was already searched without success is remembered in io->scan, relative
+ * to rpos, so that data arriving in small reads isn't scanned over and over.
+ */
+static char *
+iobuf_findnl(struct iobuf *io)
+{
+	char	*buf, *nl;
+	size_t	 len;
+
+	buf = iobuf_data(io);
+	len = iobuf_len(io);
+	if (io->scan > len)
+		io->scan = len;
+
+	if ((nl = memchr(buf + io->scan, '\n', len - io->scan)) == NULL) {
+		io->scan = len;
+		return (NULL);
+	}
+	io->scan = nl - buf;
+	return (nl);
 }
 
 char *
 iobuf_getline(struct iobuf *iobuf, size_t *rlen)
 {
-	char	*buf;
+	char	*buf, *nl;
 	size_t	 len, i;
 
+	if ((nl = iobuf_findnl(iobuf)) == NULL)
+		return (NULL);
+
 	buf = iobuf_data(iobuf);
-	len = iobuf_len(iobuf);
-
-	for (i = 0; i + 1 <= len; i++)
-		if (buf[i] == '\n') {
-			/* Note: the returned address points into the iobuf
-			 * buffer.  We NUL-end it for convenience, and discard
-			 * the data from the iobuf, so that the caller doesn't
-			 * have to do it.  The data remains "valid" as long
-			 * as the iobuf does not overwrite it, that is until
-			 * the next call to iobuf_normalize() or iobuf_extend().
-			 */
-			iobuf_drop(iobuf, i + 1);
-			len = (i && buf[i - 1] == '\r') ? i - 1 : i;
-			buf[len] = '\0';
-			if (rlen)
-				*rlen = len;
-			return (buf);
-		}
+	i = nl - buf;
+
+	/* Note: the returned address points into the iobuf
+	 * buffer.  We NUL-end it for convenience, and discard
+	 * the data from the iobuf, so that the caller doesn't
+	 * have to do it.  The data remains "valid" as long
+	 * as the iobuf does not overwrite it, that is until
+	 * the next call to iobuf_normalize(), iobuf_extend() or iobuf_grow().
+	 */
+	iobuf_drop(iobuf, i + 1);
+	len = (i && buf[i - 1] == '\r') ? i - 1 : i;
+	buf[len] = '\0';
+	if (rlen)
+		*rlen = len;
+	return (buf);
+}
+
+/*
+ * Like iobuf_getline(), but return up to nlines complete lines at once.
+ * The lines are given as offsets from *base, which stays valid under the
+ * same conditions as a line returned by iobuf_getline().
+ */
+size_t
+iobuf_getlines(struct iobuf *iobuf, struct iobuf_line *lines, size_t nlines,
+    char **base)
+{
+	char	*buf, *nl;
+	size_t	 n, off, i, len;
+
+	buf = iobuf_data(iobuf);
+	*base = buf;
+
+	for (n = 0, off = 0; n < nlines; n++) {
+		if ((nl = iobuf_findnl(iobuf)) == NULL)
+			break;
+		i = nl - buf;
+		len = (i > off && buf[i - 1] == '\r') ? i - 1 : i;
+		buf[len] = '\0';
+		lines[n].off = off;
+		lines[n].len = len - off;
+		/* Only skip the newline, the data is dropped at once below. */
+		iobuf->scan = i + 1;
+		off = i + 1;
+	}
+	if (off)
+		iobuf_drop(iobuf, off);
+	return (n);
+}
+
+/*
+ * Once the buffer is full at its maximum size without a newline, return
+ * what it holds and drop it, so that a line too long for the buffer can be
+ * consumed in parts.  A trailing CR is kept back, in case it belongs to the
+ * CRLF ending the line.  The data remains valid as for iobuf_getline().
+ */
+char *
+iobuf_getpart(struct iobuf *io, size_t *rlen)
+{
+	char	*buf;
+	size_t	 len;
 
-	return (NULL);
+	len = iobuf_len(io);
+	if (io->size < io->max || len < io->size || iobuf_findnl(io) != NULL)
+		return (NULL);
+
+	buf = iobuf_data(io);
+	if (buf[len - 1] == '\r')
+		len--;
+	if (len == 0)
+		return (NULL);
+	iobuf_drop(io, len);
+	*rlen = len;
+	return (buf);
 }
 
 void
@@ -225,22 +358,42 @@ iobuf_read(struct iobuf *io, int fd)
 	return (n);
 }
 
+/* Append data read by other means than iobuf_read(), as far as it fits */
+size_t
+iobuf_fill(struct iobuf *io, const void *data, size_t len)
+{
+	if (len > iobuf_left(io))
+		len = iobuf_left(io);
+	memcpy(io->buf + io->wpos, data, len);
+	io->wpos += len;
+
+	return (len);
+}
+
 struct ioqbuf *
 ioqbuf_alloc(struct iobuf *io, size_t len)
 {
 	struct ioqbuf   *q;
 
-	if (len < IOBUFQ_MIN)
-		len = IOBUFQ_MIN;
+	if (len <= io->qsize && (q = io->qfree) != NULL) {
+		io->qfree = q->next;
+		io->nqfree--;
+		io->qreused++;
+	} else {
+		if (len < io->qsize)
+			len = io->qsize;
 
-	if ((q = malloc(sizeof(*q) + len)) == NULL)
-		return (NULL);
+		if ((q = malloc(sizeof(*q) + len)) == NULL)
+			return (NULL);
+
+		q->size = len;
+		q->buf = (char *)(q) + sizeof(*q);
+		io->qallocated++;
+	}
 
 	q->rpos = 0;
 	q->wpos = 0;
-	q->size = len;
 	q->next = NULL;
-	q->buf = (char *)(q) + sizeof(*q);
 
 	if (io->outqlast == NULL)
 		io->outq = q;
@@ -251,12 +404,70 @@ ioqbuf_alloc(struct iobuf *io, size_t len)
 	return (q);
 }
 
+/*
+ * Keep up to qmaxfree chunks of the default size around, so steady output
+ * doesn't malloc and free a chunk for every write.
+ */
+void
+ioqbuf_free(struct iobuf *io, struct ioqbuf *q)
+{
+	if (q->size != io->qsize || io->nqfree >= io->qmaxfree) {
+		free(q);
+		return;
+	}
+
+	q->next = io->qfree;
+	io->qfree = q;
+	io->nqfree++;
+}
+
+void
+iobuf_set_qbuf(struct iobuf *io, size_t size, size_t maxfree)
+{
+	struct ioqbuf	*q;
+
+	if (size == 0)
+		size = IOBUFQ_MIN;
+
+	/* Pooled chunks of the old size can't be reused */
+	if (size != io->qsize) {
+		while ((q = io->qfree)) {
+			io->qfree = q->next;
+			free(q);
+		}
+		io->nqfree = 0;
+	}
+	while (io->nqfree > maxfree) {
+		q = io->qfree;
+		io->qfree = q->next;
+		io->nqfree--;
+		free(q);
+	}
+
+	io->qsize = size;
+	io->qmaxfree = maxfree;
+}
+
+void
+iobuf_qstats(struct iobuf *io, size_t *allocated, size_t *reused)
+{
+	*allocated = io->qallocated;
+	*reused = io->qreused;
+}
+
 size_t
 iobuf_queued(struct iobuf *io)
 {
 	return io->queued;
 }
 
+/* Size of the output chunks, reserving this much takes a pooled one */
+size_t
+iobuf_qsize(struct iobuf *io)
+{
+	return io->qsize;
+}
+
 void *
 iobuf_reserve(struct iobuf *io, size_t len)
 {
@@ -331,40 +542,103 @@ iobuf_fqueue(struct iobuf *io, const char *fmt, ...)
 	return (len);
 }
 
+/*
+ * Format straight into the last output chunk. Only if the result doesn't
+ * fit, space for it is reserved and the output is formatted a second time.
+ */
 int
 iobuf_vfqueue(struct iobuf *io, const char *fmt, va_list ap)
 {
-	char	*buf;
-	int	 len;
-
-	len = vasprintf(&buf, fmt, ap);
+	struct ioqbuf	*q;
+	va_list		 ap2;
+	char		*buf = NULL;
+	size_t		 left = 0;
+	int		 len;
+
+	if ((q = io->outqlast) != NULL) {
+		buf = q->buf + q->wpos;
+		left = q->size - q->wpos;
+	}
 
+	va_copy(ap2, ap);
+	len = vsnprintf(buf, left, fmt, ap2);
+	va_end(ap2);
 	if (len == -1)
 		return (-1);
 
-	len = iobuf_queue(io, buf, len);
-	free(buf);
+	/* vsnprintf needs room for the NUL, which isn't queued */
+	if ((size_t)len >= left) {
+		if (len == 0)
+			return (0);
+		if ((buf = iobuf_reserve(io, len + 1)) == NULL)
+			return (-1);
+		(void)vsnprintf(buf, len + 1, fmt, ap);
+		q = io->outqlast;
+		q->wpos--;
+		io->queued--;
+		return (len);
+	}
+
+	q->wpos += len;
+	io->queued += len;
 
 	return (len);
 }
 
-ssize_t
-iobuf_write(struct iobuf *io, int fd)
+/*
+ * Describe up to niov chunks of the output queue in iov.  Returns the total
+ * number of chunks, which may be more than niov.
+ */
+size_t
+iobuf_outv(struct iobuf *io, struct iovec *iov, size_t niov)
 {
-	struct iovec	 iov[IOV_MAX];
 	struct ioqbuf	*q;
-	int		 i;
-	ssize_t		 n;
+	size_t		 i;
 
 	i = 0;
 	for (q = io->outq; q ; q = q->next) {
-		if (i >= IOV_MAX)
-			break;
-		iov[i].iov_base = q->buf + q->rpos;
-		iov[i].iov_len = q->wpos - q->rpos;
+		if (i < niov) {
+			iov[i].iov_base = q->buf + q->rpos;
+			iov[i].iov_len = q->wpos - q->rpos;
+		}
 		i++;
 	}
 
+	return (i);
+}
+
+/*
+ * Append the output queue of src to the one of dst, leaving src empty.
+ */
+int
+iobuf_move(struct iobuf *dst, struct iobuf *src)
+{
+	struct ioqbuf	*q;
+	size_t		 len;
+
+	while ((q = src->outq)) {
+		len = q->wpos - q->rpos;
+		if (len && iobuf_queue(dst, q->buf + q->rpos, len) == -1)
+			return (-1);
+		src->outq = q->next;
+		src->queued -= len;
+		ioqbuf_free(src, q);
+	}
+	src->outqlast = NULL;
+
+	return (0);
+}
+
+ssize_t
+iobuf_write(struct iobuf *io, int fd)
+{
+	struct iovec	 iov[IOV_MAX];
+	size_t		 i;
+	ssize_t		 n;
+
+	if ((i = iobuf_outv(io, iov, IOV_MAX)) > IOV_MAX)
+		i = IOV_MAX;
+
 	n = writev(fd, iov, i);
 	if (n == -1) {
 		if (errno == EAGAIN || errno == EINTR)
@@ -29,10 +29,24 @@ struct iobuf {
 	size_t		 size;
 	size_t		 wpos;
 	size_t		 rpos;
+	size_t		 scan;
 
 	size_t		 queued;
 	struct ioqbuf	*outq;
 	struct ioqbuf	*outqlast;
+
+	/* written chunks of qsize bytes kept for reuse */
+	struct ioqbuf	*qfree;
+	size_t		 nqfree;
+	size_t		 qmaxfree;
+	size_t		 qsize;
+	size_t		 qallocated;
+	size_t		 qreused;
+};
+
+struct iobuf_line {
+	size_t		 off;
+	size_t		 len;
 };
 
 #define IOBUF_WANT_READ		-1
@@ -45,6 +59,8 @@ int	iobuf_init(struct iobuf *, size_t, size_t);
 void	iobuf_clear(struct iobuf *);
 
 int	iobuf_extend(struct iobuf *, size_t);
+int	iobuf_grow(struct iobuf *);
+int	iobuf_resize(struct iobuf *, size_t, size_t);
 void	iobuf_normalize(struct iobuf *);
 void	iobuf_drop(struct iobuf *, size_t);
 size_t	iobuf_space(struct iobuf *);
@@ -52,15 +68,24 @@ size_t	iobuf_len(struct iobuf *);
 size_t	iobuf_left(struct iobuf *);
 char   *iobuf_data(struct iobuf *);
 char   *iobuf_getline(struct iobuf *, size_t *);
+size_t	iobuf_getlines(struct iobuf *, struct iobuf_line *, size_t, char **);
+char   *iobuf_getpart(struct iobuf *, size_t *);
 ssize_t	iobuf_read(struct iobuf *, int);
+size_t	iobuf_fill(struct iobuf *, const void *, size_t);
 ssize_t	iobuf_read_tls(struct iobuf *, void *);
 
 size_t  iobuf_queued(struct iobuf *);
+size_t	iobuf_qsize(struct iobuf *);
+void	iobuf_set_qbuf(struct iobuf *, size_t, size_t);
+void	iobuf_qstats(struct iobuf *, size_t *, size_t *);
 void*   iobuf_reserve(struct iobuf *, size_t);
 int	iobuf_queue(struct iobuf *, const void*, size_t);
 int	iobuf_queuev(struct iobuf *, const struct iovec *, int);
 int	iobuf_fqueue(struct iobuf *, const char *, ...);
 int	iobuf_vfqueue(struct iobuf *, const char *, va_list);
+void	iobuf_drain(struct iobuf *, size_t);
+size_t	iobuf_outv(struct iobuf *, struct iovec *, size_t);
+int	iobuf_move(struct iobuf *, struct iobuf *);
 int	iobuf_flush(struct iobuf *, int);
 int	iobuf_flush_tls(struct iobuf *, void *);
 ssize_t	iobuf_write(struct iobuf *, int);
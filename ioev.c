@@ -40,6 +40,15 @@
 #include <openssl/ssl.h>
 #endif
 
+#ifdef IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <limits.h>
+#include <linux/io_uring.h>
+#endif
+
 enum {
 	IO_STATE_NONE,
 	IO_STATE_CONNECT,
@@ -57,6 +66,40 @@ enum {
 #define IO_RW			(IO_READ | IO_WRITE)
 #define IO_RESET		0x10  /* internal */
 #define IO_HELD			0x20  /* internal */
+#define IO_CORKED		0x40
+#define IO_RING			0x80  /* io_uring backend */
+
+#define IO_READING(io) (((io)->flags & IO_RW) != IO_WRITE)
+#define IO_WRITING(io) (((io)->flags & IO_RW) != IO_READ)
+
+#ifdef IO_URING
+#define IO_RING_ENTRIES		64
+#define IO_RING_NBUFS		16	/* provided buffers, power of two */
+#define IO_RING_BUFSZ		16384
+#define IO_RING_BGID		0
+#define IO_RING_MAXWRITES	8	/* linked writev per io in flight */
+
+/* io->ring */
+#define IO_RING_ARMED		0x01	/* read posted */
+#define IO_RING_MULTISHOT	0x02	/* stream socket, multishot recv */
+#define IO_RING_EOF		0x04
+#define IO_RING_EOFSENT		0x08
+#define IO_RING_DEAD		0x10	/* freed, operations in flight */
+
+/* user_data is the io with the operation in the low bits */
+#define IO_RING_OP_READ		1
+#define IO_RING_OP_WRITE	2
+#define IO_RING_OP_CANCEL	3
+#define IO_RING_OP_MASK		3
+
+struct io_ring_buf {
+	uint16_t	 bid;
+	uint32_t	 off;
+	uint32_t	 len;
+};
+
+TAILQ_HEAD(io_ring_list, io);
+#endif
 
 struct io {
 	int		 sock;
@@ -68,8 +111,27 @@ struct io {
 	int		 flags;
 	int		 state;
 	struct event	 ev;
+	short		 evmask;	/* armed events */
+	void		(*evdispatch)(int, short, void *);
+	int		 evtimeout;
 	void		*tls;
 	const char	*error; /* only valid immediately on callback */
+	size_t		 nreads;
+	size_t		 nwrites;
+	size_t		 nrearms;
+#ifdef IO_URING
+	int			 ring;
+	int			 rwrites;
+	size_t			 rwritten;
+	size_t			 rqueued;
+	int			 rerror;
+	struct iovec		*riov;
+	size_t			 riovsz;
+	struct io_ring_buf	 rpend[IO_RING_NBUFS];
+	size_t			 nrpend;
+	struct io_ring_list	*rlist;
+	TAILQ_ENTRY(io)		 rentry;
+#endif
 };
 
 const char* io_strflags(int);
@@ -98,9 +160,71 @@ void	io_dispatch_write_tls(int, short, void *);
 void	io_reload_tls(struct io *io);
 #endif
 
+#ifdef IO_URING
+static int	io_ring_init(void);
+static void	io_ring_close(void);
+static int	io_ring_reserve(unsigned int);
+static struct io_uring_sqe *io_ring_sqe(void);
+static void	io_ring_submit(void);
+static void	io_ring_recycle(uint16_t);
+static void	io_ring_queue(struct io *);
+static void	io_ring_schedule(struct io *);
+static void	io_ring_unqueue(struct io *);
+static void	io_ring_flush(int, short, void *);
+static void	io_ring_arm(struct io *);
+static void	io_ring_writev(struct io *);
+static void	io_ring_deliver(struct io *);
+static void	io_ring_reap(void);
+static void	io_ring_dispatch(int, short, void *);
+static void	io_ring_read(struct io *, int, unsigned int);
+static void	io_ring_write(struct io *, int);
+static int	io_ring_release(struct io *);
+static void	io_ring_destroy(struct io *);
+#endif
+
 static struct io	*current = NULL;
 static uint64_t		 frame = 0;
 static int		_io_debug = 0;
+static struct event_base *io_evbase = NULL;
+
+#ifdef IO_URING
+struct io_ring {
+	int			 state;	/* 0 untried, 1 up, -1 unusable */
+	int			 fd;
+	void			*sqmap;
+	size_t			 sqmapsz;
+	void			*cqmap;
+	size_t			 cqmapsz;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqessz;
+	unsigned int		*sqhead;
+	unsigned int		*sqtail;
+	unsigned int		*sqarray;
+	unsigned int		 sqmask;
+	unsigned int		 sqentries;
+	unsigned int		 sqlocal;	/* tail not yet published */
+	unsigned int		 nsubmit;
+	unsigned int		*cqhead;
+	unsigned int		*cqtail;
+	unsigned int		 cqmask;
+	struct io_uring_cqe	*cqes;
+	unsigned int		 inflight;
+
+	struct io_uring_buf_ring *br;
+	size_t			 brsz;
+	uint16_t		 brtail;
+	char			*bufs;
+
+	struct event		 ev;
+	struct event		 flushev;
+	int			 scheduled;
+	struct io_ring_list	 lists[2];
+	int			 cur;
+	struct io_ring_list	 dead;
+};
+
+static struct io_ring	 ring = { .fd = -1 };
+#endif
 
 #define io_debug(args...) do { if (_io_debug) printf(args); } while(0)
 
@@ -151,6 +275,21 @@ io_strevent(int evt)
 	}
 }
 
+/*
+ * Attach the events of all io to evbase instead of the global base
+ * set up by event_init().
+ */
+void
+io_set_evbase(struct event_base *evbase)
+{
+#ifdef IO_URING
+	/* The ring events belong to the previous base */
+	if (evbase != io_evbase)
+		io_ring_close();
+#endif
+	io_evbase = evbase;
+}
+
 void
 io_set_nonblocking(int fd)
 {
@@ -287,6 +426,12 @@ io_free(struct io *io)
 		io->sock = -1;
 	}
 
+#ifdef IO_URING
+	/* Released once its ring operations complete */
+	if (io->flags & IO_RING && io_ring_release(io) == -1)
+		return;
+#endif
+
 	iobuf_clear(&io->iobuf);
 	free(io);
 }
@@ -345,6 +490,27 @@ io_set_lowat(struct io *io, size_t lowat)
 	io->lowat = lowat;
 }
 
+void
+io_set_qbuf(struct io *io, size_t size, size_t maxfree)
+{
+	io_debug("io_set_qbuf(%p, %zu, %zu)\n", io, size, maxfree);
+
+	iobuf_set_qbuf(&io->iobuf, size, maxfree);
+}
+
+/*
+ * Start the input buffer at size bytes, growing it as needed up to max.
+ * Once full at max, IO_ERROR is reported unless the data is taken with
+ * io_getpart().
+ */
+int
+io_set_rbuf(struct io *io, size_t size, size_t max)
+{
+	io_debug("io_set_rbuf(%p, %zu, %zu)\n", io, size, max);
+
+	return iobuf_resize(&io->iobuf, size, max);
+}
+
 void
 io_pause(struct io *io, int dir)
 {
@@ -363,6 +529,41 @@ io_resume(struct io *io, int dir)
 	io_reload(io);
 }
 
+/*
+ * While corked, writes are only queued. The queue is flushed and the event
+ * updated once on uncork.
+ */
+void
+io_cork(struct io *io)
+{
+	io_debug("io_cork(%p)\n", io);
+
+	io->flags |= IO_CORKED;
+}
+
+void
+io_uncork(struct io *io)
+{
+	io_debug("io_uncork(%p)\n", io);
+
+	if (!(io->flags & IO_CORKED))
+		errx(1, "io_uncork: io is not corked");
+
+	io->flags &= ~IO_CORKED;
+
+	/*
+	 * Try to write right away instead of waiting for the event loop.
+	 * Errors are left for io_dispatch to report.
+	 */
+	if (IO_WRITING(io) && !(io->flags & IO_PAUSE_OUT) && io->sock != -1 &&
+	    io->tls == NULL && !(io->flags & IO_RING) && io_queued(io)) {
+		io->nwrites++;
+		(void)iobuf_write(&io->iobuf, io->sock);
+	}
+
+	io_reload(io);
+}
+
 void
 io_set_read(struct io *io)
 {
@@ -469,17 +670,37 @@ io_printf(struct io *io, const char *fmt, ...)
 int
 io_vprintf(struct io *io, const char *fmt, va_list ap)
 {
+	int r;
 
-	char *buf;
-	int len;
+	r = iobuf_vfqueue(&io->iobuf, fmt, ap);
 
-	len = vasprintf(&buf, fmt, ap);
-	if (len == -1)
-		return -1;
-	len = io_write(io, buf, len);
-	free(buf);
+	io_reload(io);
 
-	return len;
+	return r;
+}
+
+void *
+io_reserve(struct io *io, size_t len)
+{
+	void *r;
+
+	r = iobuf_reserve(&io->iobuf, len);
+
+	io_reload(io);
+
+	return r;
+}
+
+int
+io_move(struct io *dst, struct io *src)
+{
+	int r;
+
+	r = iobuf_move(&dst->iobuf, &src->iobuf);
+
+	io_reload(dst);
+
+	return r;
 }
 
 size_t
@@ -488,6 +709,26 @@ io_queued(struct io *io)
 	return iobuf_queued(&io->iobuf);
 }
 
+size_t
+io_qsize(struct io *io)
+{
+	return iobuf_qsize(&io->iobuf);
+}
+
+void
+io_qstats(struct io *io, size_t *allocated, size_t *reused)
+{
+	iobuf_qstats(&io->iobuf, allocated, reused);
+}
+
+void
+io_iostats(struct io *io, size_t *reads, size_t *writes, size_t *rearms)
+{
+	*reads = io->nreads;
+	*writes = io->nwrites;
+	*rearms = io->nrearms;
+}
+
 /*
  * Buffered input functions
  */
@@ -510,6 +751,19 @@ io_getline(struct io *io, size_t *sz)
 	return iobuf_getline(&io->iobuf, sz);
 }
 
+size_t
+io_getlines(struct io *io, struct iobuf_line *lines, size_t nlines,
+    char **base)
+{
+	return iobuf_getlines(&io->iobuf, lines, nlines, base);
+}
+
+char *
+io_getpart(struct io *io, size_t *sz)
+{
+	return iobuf_getpart(&io->iobuf, sz);
+}
+
 void
 io_drop(struct io *io, size_t sz)
 {
@@ -517,9 +771,6 @@ io_drop(struct io *io, size_t sz)
 }
 
 
-#define IO_READING(io) (((io)->flags & IO_RW) != IO_WRITE)
-#define IO_WRITING(io) (((io)->flags & IO_RW) != IO_READ)
-
 /*
  * Setup the necessary events as required by the current io state,
  * honouring duplex mode and i/o pauses.
@@ -529,8 +780,8 @@ io_reload(struct io *io)
 {
 	short	events;
 
-	/* io will be reloaded at release time */
-	if (io->flags & IO_HELD)
+	/* io will be reloaded at release or uncork time */
+	if (io->flags & (IO_HELD | IO_CORKED))
 		return;
 
 	iobuf_normalize(&io->iobuf);
@@ -542,6 +793,13 @@ io_reload(struct io *io)
 	}
 #endif
 
+#ifdef IO_URING
+	if (io->flags & IO_RING) {
+		io_ring_schedule(io);
+		return;
+	}
+#endif
+
 	io_debug("io_reload(%p)\n", io);
 
 	events = 0;
@@ -553,11 +811,17 @@ io_reload(struct io *io)
 	io_reset(io, events, io_dispatch);
 }
 
-/* Set the requested event. */
+/*
+ * Set the requested event.  An event already armed for the same thing is
+ * left in place, only restarting its timeout, so that reloading the io
+ * does not cost a round of event_del/event_add.  io_dispatch events are
+ * persistent and stay armed across dispatches.
+ */
 void
 io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 {
 	struct timeval	tv, *ptv;
+	int		armed;
 
 	io_debug("io_reset(%p, %s, %p) -> %s\n",
 	    io, io_evstr(events), dispatch, io_strio(io));
@@ -568,9 +832,25 @@ io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 	 */
 	io->flags |= IO_RESET;
 
-	if (event_initialized(&io->ev) &&
-	    event_pending(&io->ev, EV_READ|EV_WRITE, NULL))
+	if (io->timeout >= 0) {
+		tv.tv_sec = io->timeout / 1000;
+		tv.tv_usec = (io->timeout % 1000) * 1000;
+		ptv = &tv;
+	} else
+		ptv = NULL;
+
+	armed = event_initialized(&io->ev) &&
+	    event_pending(&io->ev, EV_READ|EV_WRITE, NULL);
+	if (armed && events == io->evmask && dispatch == io->evdispatch &&
+	    io->sock == EVENT_FD(&io->ev) && io->timeout == io->evtimeout) {
+		if (ptv != NULL)
+			event_add(&io->ev, ptv);
+		return;
+	}
+
+	if (armed)
 		event_del(&io->ev);
+	io->evmask = 0;
 
 	/*
 	 * The io is paused by the user, so we don't want the timeout to be
@@ -579,15 +859,17 @@ io_reset(struct io *io, short events, void (*dispatch)(int, short, void*))
 	if (events == 0)
 		return;
 
-	event_set(&io->ev, io->sock, events, dispatch, io);
-	if (io->timeout >= 0) {
-		tv.tv_sec = io->timeout / 1000;
-		tv.tv_usec = (io->timeout % 1000) * 1000;
-		ptv = &tv;
-	} else
-		ptv = NULL;
+	event_set(&io->ev, io->sock,
+	    dispatch == io_dispatch ? events | EV_PERSIST : events,
+	    dispatch, io);
+	if (io_evbase != NULL)
+		event_base_set(io_evbase, &io->ev);
 
 	event_add(&io->ev, ptv);
+	io->evmask = events;
+	io->evdispatch = dispatch;
+	io->evtimeout = io->timeout;
+	io->nrearms++;
 }
 
 size_t
@@ -622,6 +904,10 @@ io_strflags(int flags)
 		(void)strlcat(buf, ",F_PI", sizeof buf);
 	if (flags & IO_PAUSE_OUT)
 		(void)strlcat(buf, ",F_PO", sizeof buf);
+	if (flags & IO_CORKED)
+		(void)strlcat(buf, ",F_C", sizeof buf);
+	if (flags & IO_RING)
+		(void)strlcat(buf, ",F_R", sizeof buf);
 
 	return buf;
 }
@@ -698,6 +984,7 @@ io_dispatch(__unused int fd, short ev, void *humppa)
 	}
 
 	if (ev & EV_WRITE && (w = io_queued(io))) {
+		io->nwrites++;
 		if ((n = iobuf_write(&io->iobuf, io->sock)) < 0) {
 			if (n == IOBUF_WANT_WRITE) /* kqueue bug? */
 				goto read;
@@ -718,6 +1005,14 @@ io_dispatch(__unused int fd, short ev, void *humppa)
 
 	if (ev & EV_READ) {
 		iobuf_normalize(&io->iobuf);
+		/* read(2) into a full buffer returns 0 and looks like EOF */
+		if (iobuf_left(&io->iobuf) == 0 &&
+		    iobuf_grow(&io->iobuf) == -1) {
+			io->error = "input buffer full";
+			io_callback(io, IO_ERROR);
+			goto leave;
+		}
+		io->nreads++;
 		if ((n = iobuf_read(&io->iobuf, io->sock)) < 0) {
 			if (n == IOBUF_CLOSED)
 				io_callback(io, IO_DISCONNECTED);
@@ -948,6 +1243,13 @@ io_dispatch_read_tls(int fd, short event, void *humppa)
 
 again:
 	iobuf_normalize(&io->iobuf);
+	if (iobuf_left(&io->iobuf) == 0 &&
+	    iobuf_grow(&io->iobuf) == -1) {
+		io->error = "input buffer full";
+		io_callback(io, IO_ERROR);
+		goto leave;
+	}
+	io->nreads++;
 	switch ((n = iobuf_read_tls(&io->iobuf, (SSL*)io->tls))) {
 	case IOBUF_WANT_READ:
 		io_reset(io, EV_READ, io_dispatch_read_tls);
@@ -995,6 +1297,7 @@ io_dispatch_write_tls(int fd, short event, void *humppa)
 	}
 
 	w = io_queued(io);
+	io->nwrites++;
 	switch ((n = iobuf_write_tls(&io->iobuf, (SSL*)io->tls))) {
 	case IOBUF_WANT_READ:
 		io_reset(io, EV_READ, io_dispatch_write_tls);
@@ -1065,3 +1368,614 @@ io_reload_tls(struct io *io)
 }
 
 #endif /* IO_TLS */
+
+#ifdef IO_URING
+
+/*
+ * Move io to the io_uring backend.  Instead of waiting for readiness and
+ * calling read(2), a read stays posted on the ring with buffers provided to
+ * the kernel, and the output queue is written with linked writev.  New
+ * submissions are batched and entered once per event loop iteration.
+ * Returns -1, leaving the io on libevent, if the kernel has no usable ring
+ * or the io needs TLS or a timeout, which the ring does not handle.
+ */
+int
+io_set_ring(struct io *io)
+{
+	socklen_t	len;
+	int		type, flags;
+
+	io_debug("io_set_ring(%p)\n", io);
+
+	if (io->sock == -1 || io->tls != NULL || io->timeout >= 0 ||
+	    io->flags & IO_RING)
+		return (-1);
+	if (io_ring_init() == -1)
+		return (-1);
+
+	/* Non-blocking operations fail with EAGAIN instead of being polled */
+	if ((flags = fcntl(io->sock, F_GETFL)) == -1 ||
+	    fcntl(io->sock, F_SETFL, flags & ~O_NONBLOCK) == -1)
+		return (-1);
+
+	len = sizeof(type);
+	if (getsockopt(io->sock, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+	    type == SOCK_STREAM)
+		io->ring |= IO_RING_MULTISHOT;
+
+	if (event_initialized(&io->ev))
+		event_del(&io->ev);
+	io->flags |= IO_RING;
+	io_reload(io);
+
+	return (0);
+}
+
+static int
+io_ring_init(void)
+{
+	struct io_uring_params	 p;
+	struct io_uring_buf_reg	 reg;
+	char			*sq, *cq;
+	void			*map;
+	int			 i;
+
+	if (ring.state != 0)
+		return (ring.state == 1 ? 0 : -1);
+
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &p)) ==
+	    -1) {
+		io_debug("io_ring_init: io_uring_setup: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	ring.sqmapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cqmapsz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cqmapsz > ring.sqmapsz)
+			ring.sqmapsz = ring.cqmapsz;
+		ring.cqmapsz = 0;
+	}
+	if ((map = mmap(NULL, ring.sqmapsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING)) ==
+	    MAP_FAILED)
+		goto fail;
+	ring.sqmap = map;
+	if (ring.cqmapsz) {
+		if ((map = mmap(NULL, ring.cqmapsz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING)) ==
+		    MAP_FAILED)
+			goto fail;
+		ring.cqmap = map;
+	}
+	ring.sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((map = mmap(NULL, ring.sqessz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES)) == MAP_FAILED)
+		goto fail;
+	ring.sqes = map;
+
+	sq = ring.sqmap;
+	cq = ring.cqmap != NULL ? ring.cqmap : ring.sqmap;
+	ring.sqhead = (unsigned int *)(sq + p.sq_off.head);
+	ring.sqtail = (unsigned int *)(sq + p.sq_off.tail);
+	ring.sqarray = (unsigned int *)(sq + p.sq_off.array);
+	ring.sqmask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ring.sqentries = *(unsigned int *)(sq + p.sq_off.ring_entries);
+	ring.sqlocal = *ring.sqtail;
+	ring.cqhead = (unsigned int *)(cq + p.cq_off.head);
+	ring.cqtail = (unsigned int *)(cq + p.cq_off.tail);
+	ring.cqmask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Buffers the kernel picks from when a read completes */
+	ring.brsz = IO_RING_NBUFS * sizeof(struct io_uring_buf);
+	if ((map = mmap(NULL, ring.brsz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		goto fail;
+	ring.br = map;
+	if ((ring.bufs = malloc(IO_RING_NBUFS * IO_RING_BUFSZ)) == NULL)
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring.br;
+	reg.ring_entries = IO_RING_NBUFS;
+	reg.bgid = IO_RING_BGID;
+	if (syscall(__NR_io_uring_register, ring.fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		io_debug("io_ring_init: IORING_REGISTER_PBUF_RING: %s\n",
+		    strerror(errno));
+		goto fail;
+	}
+	for (i = 0; i < IO_RING_NBUFS; i++)
+		io_ring_recycle(i);
+
+	TAILQ_INIT(&ring.lists[0]);
+	TAILQ_INIT(&ring.lists[1]);
+	TAILQ_INIT(&ring.dead);
+	event_set(&ring.ev, ring.fd, EV_READ | EV_PERSIST, io_ring_dispatch,
+	    NULL);
+	event_set(&ring.flushev, -1, 0, io_ring_flush, NULL);
+	if (io_evbase != NULL) {
+		event_base_set(io_evbase, &ring.ev);
+		event_base_set(io_evbase, &ring.flushev);
+	}
+	if (event_add(&ring.ev, NULL) == -1)
+		goto fail;
+
+	ring.state = 1;
+	return (0);
+
+    fail:
+	io_ring_close();
+	ring.state = -1;
+	return (-1);
+}
+
+/*
+ * Cancel what is left on the ring and wait for it, so that the kernel no
+ * longer uses the buffers.  All io on the ring must have been freed.
+ */
+static void
+io_ring_close(void)
+{
+	struct io_uring_sqe	*sqe;
+
+	if (ring.state == 1) {
+		event_del(&ring.ev);
+		event_del(&ring.flushev);
+		if (ring.inflight && io_ring_reserve(1) == 0) {
+			sqe = io_ring_sqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+			sqe->user_data = IO_RING_OP_CANCEL;
+		}
+		io_ring_submit();
+		while (ring.inflight) {
+			if (syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+				if (errno == EINTR)
+					continue;
+				err(1, "io_ring_close: io_uring_enter");
+			}
+			io_ring_reap();
+		}
+	}
+
+	if (ring.sqes != NULL)
+		munmap(ring.sqes, ring.sqessz);
+	if (ring.cqmap != NULL)
+		munmap(ring.cqmap, ring.cqmapsz);
+	if (ring.sqmap != NULL)
+		munmap(ring.sqmap, ring.sqmapsz);
+	if (ring.fd != -1)
+		close(ring.fd);
+	if (ring.br != NULL)
+		munmap(ring.br, ring.brsz);
+	free(ring.bufs);
+
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+/* Make room for n consecutive submissions, entering the ring if needed */
+static int
+io_ring_reserve(unsigned int n)
+{
+	unsigned int	head;
+
+	head = __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE);
+	if (ring.sqlocal - head + n <= ring.sqentries)
+		return (0);
+	io_ring_submit();
+	head = __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE);
+	if (ring.sqlocal - head + n <= ring.sqentries)
+		return (0);
+	return (-1);
+}
+
+/* Only call after io_ring_reserve() */
+static struct io_uring_sqe *
+io_ring_sqe(void)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned int		 idx;
+
+	idx = ring.sqlocal & ring.sqmask;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sqarray[idx] = idx;
+	ring.sqlocal++;
+	ring.nsubmit++;
+	ring.inflight++;
+
+	return (sqe);
+}
+
+static void
+io_ring_submit(void)
+{
+	int	n;
+
+	if (ring.nsubmit == 0)
+		return;
+
+	__atomic_store_n(ring.sqtail, ring.sqlocal, __ATOMIC_RELEASE);
+	n = syscall(__NR_io_uring_enter, ring.fd, ring.nsubmit, 0, 0, NULL, 0);
+	if (n == -1) {
+		/* retried on the next dispatch */
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			return;
+		err(1, "io_ring_submit: io_uring_enter");
+	}
+	ring.nsubmit -= n;
+}
+
+static void
+io_ring_recycle(uint16_t bid)
+{
+	struct io_uring_buf	*buf;
+
+	buf = &ring.br->bufs[ring.brtail & (IO_RING_NBUFS - 1)];
+	buf->addr = (uintptr_t)(ring.bufs + (size_t)bid * IO_RING_BUFSZ);
+	buf->len = IO_RING_BUFSZ;
+	buf->bid = bid;
+	ring.brtail++;
+	__atomic_store_n(&ring.br->tail, ring.brtail, __ATOMIC_RELEASE);
+}
+
+/* Have the io looked at on the next flush */
+static void
+io_ring_queue(struct io *io)
+{
+	if (io->rlist != NULL)
+		return;
+	io->rlist = &ring.lists[ring.cur];
+	TAILQ_INSERT_TAIL(io->rlist, io, rentry);
+}
+
+static void
+io_ring_schedule(struct io *io)
+{
+	io_ring_queue(io);
+	if (!ring.scheduled) {
+		ring.scheduled = 1;
+		event_active(&ring.flushev, EV_TIMEOUT, 1);
+	}
+}
+
+static void
+io_ring_unqueue(struct io *io)
+{
+	if (io->rlist == NULL)
+		return;
+	TAILQ_REMOVE(io->rlist, io, rentry);
+	io->rlist = NULL;
+}
+
+static void
+io_ring_flush(__unused int fd, __unused short ev, __unused void *arg)
+{
+	struct io_ring_list	*list;
+	struct io		*io;
+
+	/* io reloaded from the callbacks below wait for the next flush */
+	list = &ring.lists[ring.cur];
+	ring.cur ^= 1;
+	ring.scheduled = 0;
+
+	while ((io = TAILQ_FIRST(list)) != NULL) {
+		io_ring_unqueue(io);
+		if (IO_READING(io) && !(io->flags & IO_PAUSE_IN) &&
+		    (io->nrpend ||
+		    (io->ring & (IO_RING_EOF | IO_RING_EOFSENT)) ==
+		    IO_RING_EOF)) {
+			/* reloaded, and armed again, when the frame ends */
+			io_ring_deliver(io);
+			continue;
+		}
+		io_ring_arm(io);
+		io_ring_writev(io);
+	}
+
+	io_ring_submit();
+}
+
+static void
+io_ring_arm(struct io *io)
+{
+	struct io_uring_sqe	*sqe;
+
+	if (!IO_READING(io) || io->flags & IO_PAUSE_IN || io->nrpend ||
+	    io->ring & (IO_RING_ARMED | IO_RING_EOF))
+		return;
+	if (io_ring_reserve(1) == -1) {
+		io_ring_queue(io);
+		return;
+	}
+
+	sqe = io_ring_sqe();
+	if (io->ring & IO_RING_MULTISHOT) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	} else {
+		sqe->opcode = IORING_OP_READ;
+		sqe->len = IO_RING_BUFSZ;
+		sqe->off = (uint64_t)-1;
+	}
+	sqe->fd = io->sock;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = IO_RING_BGID;
+	sqe->user_data = (uintptr_t)io | IO_RING_OP_READ;
+	io->ring |= IO_RING_ARMED;
+	io->nrearms++;
+}
+
+/*
+ * Submit the output queue as a chain of writev.  A short write breaks the
+ * chain, so what completes is always the head of the queue.  The chunks
+ * stay in place until the whole chain is done.
+ */
+static void
+io_ring_writev(struct io *io)
+{
+	struct io_uring_sqe	*sqe;
+	struct iovec		*iov;
+	size_t			 n, i, cnt;
+
+	if (!IO_WRITING(io) || io->flags & IO_PAUSE_OUT || io->rwrites ||
+	    io_queued(io) == 0)
+		return;
+
+	if ((n = iobuf_outv(&io->iobuf, NULL, 0)) >
+	    IO_RING_MAXWRITES * IOV_MAX)
+		n = IO_RING_MAXWRITES * IOV_MAX;
+	if (io_ring_reserve((n + IOV_MAX - 1) / IOV_MAX) == -1) {
+		io_ring_queue(io);
+		return;
+	}
+	if (n > io->riovsz) {
+		if ((iov = reallocarray(io->riov, n, sizeof(*iov))) == NULL)
+			err(1, "io_ring_writev");
+		io->riov = iov;
+		io->riovsz = n;
+	}
+	(void)iobuf_outv(&io->iobuf, io->riov, n);
+
+	io->rwritten = 0;
+	io->rerror = 0;
+	io->rqueued = io_queued(io);
+	for (i = 0; i < n; i += cnt) {
+		cnt = n - i > IOV_MAX ? IOV_MAX : n - i;
+		sqe = io_ring_sqe();
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = io->sock;
+		sqe->addr = (uintptr_t)(io->riov + i);
+		sqe->len = cnt;
+		sqe->off = (uint64_t)-1;
+		if (i + cnt < n)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (uintptr_t)io | IO_RING_OP_WRITE;
+		io->rwrites++;
+		io->nwrites++;
+	}
+}
+
+/* Move completed reads into the input buffer */
+static void
+io_ring_deliver(struct io *io)
+{
+	struct io_ring_buf	*rbuf;
+	size_t			 n;
+
+	io_frame_enter("io_ring_deliver", io, EV_READ);
+
+	if (io->nrpend == 0) {
+		io->ring |= IO_RING_EOFSENT;
+		io_callback(io, IO_DISCONNECTED);
+		goto leave;
+	}
+
+	iobuf_normalize(&io->iobuf);
+	if (iobuf_left(&io->iobuf) == 0 &&
+	    iobuf_grow(&io->iobuf) == -1) {
+		io->error = "input buffer full";
+		io_callback(io, IO_ERROR);
+		goto leave;
+	}
+
+	while (io->nrpend && iobuf_left(&io->iobuf)) {
+		rbuf = &io->rpend[0];
+		n = iobuf_fill(&io->iobuf,
+		    ring.bufs + (size_t)rbuf->bid * IO_RING_BUFSZ + rbuf->off,
+		    rbuf->len);
+		rbuf->off += n;
+		rbuf->len -= n;
+		if (rbuf->len == 0) {
+			io_ring_recycle(rbuf->bid);
+			io->nrpend--;
+			memmove(io->rpend, io->rpend + 1,
+			    io->nrpend * sizeof(*rbuf));
+		}
+	}
+	io_callback(io, IO_DATAIN);
+
+    leave:
+	io_frame_leave(io);
+}
+
+static void
+io_ring_reap(void)
+{
+	struct io_uring_cqe	*cqe;
+	struct io		*io;
+	uint64_t		 data;
+	unsigned int		 head, tail, flags;
+	int			 res;
+
+	head = *ring.cqhead;
+	tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &ring.cqes[head & ring.cqmask];
+		data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		__atomic_store_n(ring.cqhead, head + 1, __ATOMIC_RELEASE);
+
+		if (!(flags & IORING_CQE_F_MORE))
+			ring.inflight--;
+		io = (struct io *)(uintptr_t)(data &
+		    ~(uint64_t)IO_RING_OP_MASK);
+		switch (data & IO_RING_OP_MASK) {
+		case IO_RING_OP_READ:
+			io_ring_read(io, res, flags);
+			break;
+		case IO_RING_OP_WRITE:
+			io_ring_write(io, res);
+			break;
+		}
+	}
+}
+
+static void
+io_ring_dispatch(__unused int fd, __unused short ev, __unused void *arg)
+{
+	io_ring_reap();
+
+	/* left over when the submission queue was full */
+	if (!TAILQ_EMPTY(&ring.lists[ring.cur]) && !ring.scheduled) {
+		ring.scheduled = 1;
+		event_active(&ring.flushev, EV_TIMEOUT, 1);
+	}
+	io_ring_submit();
+}
+
+static void
+io_ring_read(struct io *io, int res, unsigned int flags)
+{
+	struct io_ring_buf	*rbuf;
+	uint16_t		 bid;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		io->ring &= ~IO_RING_ARMED;
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (res <= 0 || io->ring & IO_RING_DEAD)
+			io_ring_recycle(bid);
+		else {
+			io->nreads++;
+			rbuf = &io->rpend[io->nrpend++];
+			rbuf->bid = bid;
+			rbuf->off = 0;
+			rbuf->len = res;
+		}
+	}
+
+	if (io->ring & IO_RING_DEAD) {
+		io_ring_destroy(io);
+		return;
+	}
+
+	if (res == 0)
+		io->ring |= IO_RING_EOF;
+	else if (res < 0) {
+		switch (-res) {
+		case ENOBUFS:
+		case EAGAIN:
+		case EINTR:
+		case ECANCELED:
+			break;
+		case EINVAL:
+		case EOPNOTSUPP:
+			/* no multishot recv in this kernel */
+			if (io->ring & IO_RING_MULTISHOT) {
+				io->ring &= ~IO_RING_MULTISHOT;
+				break;
+			}
+			/* FALLTHROUGH */
+		default:
+			io_frame_enter("io_ring_read", io, EV_READ);
+			io->error = strerror(-res);
+			errno = -res;
+			io_callback(io, IO_ERROR);
+			io_frame_leave(io);
+			return;
+		}
+	}
+
+	io_ring_schedule(io);
+}
+
+static void
+io_ring_write(struct io *io, int res)
+{
+	io->rwrites--;
+	if (res > 0)
+		io->rwritten += res;
+	else if (res < 0 && res != -ECANCELED && io->rerror == 0)
+		io->rerror = -res;
+	if (io->rwrites)
+		return;
+
+	if (io->ring & IO_RING_DEAD) {
+		io_ring_destroy(io);
+		return;
+	}
+
+	io_frame_enter("io_ring_write", io, EV_WRITE);
+
+	iobuf_drain(&io->iobuf, io->rwritten);
+	if (io->rerror == EPIPE)
+		io_callback(io, IO_DISCONNECTED);
+	else if (io->rerror && io->rerror != EAGAIN && io->rerror != EINTR) {
+		io->error = strerror(io->rerror);
+		errno = io->rerror;
+		io_callback(io, IO_ERROR);
+	} else if (io->rqueued > io->lowat &&
+	    io->rqueued - io->rwritten <= io->lowat)
+		io_callback(io, IO_LOWAT);
+
+	io_frame_leave(io);
+}
+
+/* Returns -1 if the io must stay around for operations in flight */
+static int
+io_ring_release(struct io *io)
+{
+	struct io_uring_sqe	*sqe;
+
+	io_ring_unqueue(io);
+	while (io->nrpend)
+		io_ring_recycle(io->rpend[--io->nrpend].bid);
+
+	if (io->ring & IO_RING_ARMED && io_ring_reserve(1) == 0) {
+		sqe = io_ring_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uintptr_t)io | IO_RING_OP_READ;
+		sqe->user_data = IO_RING_OP_CANCEL;
+	}
+	if (io->ring & IO_RING_ARMED || io->rwrites) {
+		io->ring |= IO_RING_DEAD;
+		io->rlist = &ring.dead;
+		TAILQ_INSERT_TAIL(io->rlist, io, rentry);
+		return (-1);
+	}
+
+	free(io->riov);
+	io->riov = NULL;
+	return (0);
+}
+
+static void
+io_ring_destroy(struct io *io)
+{
+	if (io->ring & IO_RING_ARMED || io->rwrites)
+		return;
+
+	io_ring_unqueue(io);
+	free(io->riov);
+	iobuf_clear(&io->iobuf);
+	free(io);
+}
+
+#endif /* IO_URING */
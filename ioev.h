@@ -40,7 +40,10 @@ enum {
 #endif
 
 struct io;
+struct iobuf_line;
+struct event_base;
 
+void io_set_evbase(struct event_base *);
 void io_set_nonblocking(int);
 void io_set_nolinger(int);
 
@@ -52,11 +55,16 @@ void io_set_fd(struct io *, int);
 void io_set_callback(struct io *io, void(*)(struct io *, int, void *), void *);
 void io_set_timeout(struct io *, int);
 void io_set_lowat(struct io *, size_t);
+void io_set_qbuf(struct io *, size_t, size_t);
+int io_set_rbuf(struct io *, size_t, size_t);
 void io_pause(struct io *, int);
 void io_resume(struct io *, int);
+void io_cork(struct io *);
+void io_uncork(struct io *);
 void io_reload(struct io *);
 int io_connect(struct io *, const struct sockaddr *, const struct sockaddr *);
 int io_start_tls(struct io *, void *);
+int io_set_ring(struct io *);
 const char* io_strio(struct io *);
 const char* io_strevent(int);
 const char* io_error(struct io *);
@@ -70,10 +78,17 @@ int io_writev(struct io *, const struct iovec *, int);
 int io_print(struct io *, const char *);
 int io_printf(struct io *, const char *, ...);
 int io_vprintf(struct io *, const char *, va_list);
+void* io_reserve(struct io *, size_t);
+int io_move(struct io *, struct io *);
 size_t io_queued(struct io *);
+size_t io_qsize(struct io *);
+void io_qstats(struct io *, size_t *, size_t *);
+void io_iostats(struct io *, size_t *, size_t *, size_t *);
 
 /* Buffered input functions */
 void* io_data(struct io *);
 size_t io_datalen(struct io *);
 char* io_getline(struct io *, size_t *);
+size_t io_getlines(struct io *, struct iobuf_line *, size_t, char **);
+char* io_getpart(struct io *, size_t *);
 void io_drop(struct io *, size_t);
@@ -16,9 +16,14 @@
 #define _GNU_SOURCE 1
 
 #include <sys/time.h>
-#include <sys/tree.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -28,16 +33,21 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "openbsd-compat.h"
 #include "opensmtpd.h"
 #include "ioev.h"
+#include "iobuf.h"
 
 #define NITEMS(x) (sizeof(x) / sizeof(*x))
 
@@ -45,511 +55,528 @@ struct osmtpd_callback {
 	enum osmtpd_type type;
 	enum osmtpd_phase phase;
 	int incoming;
-	void (*osmtpd_cb)(struct osmtpd_callback *, struct osmtpd_ctx *, char *,
+	void (*osmtpd_cb)(struct osmtpd_callback *, struct osmtpd_ctx *,
 	    char *);
 	void *cb;
 	int doregister;
 	int storereport;
+	int batch;
+	/* cb takes data-lines in parts */
+	int part;
 };
 
+/*
+ * Bump allocator. Allocations are carved from an inline buffer first and
+ * from malloced overflow blocks after that. Nothing is freed individually,
+ * the whole arena is released at once by osmtpd_arena_reset.
+ */
+struct osmtpd_arenablk {
+	struct osmtpd_arenablk *next;
+	char data[];
+};
+
+struct osmtpd_arena {
+	char *base;
+	size_t size;
+	char *cur;
+	size_t left;
+	struct osmtpd_arenablk *blk;
+	/* Bytes in overflow blocks */
+	size_t mem;
+};
+
+#define OSMTPD_ARENA_BLKSZ 1024
+
+/*
+ * Interned string. Equal strings share one refcounted copy, so sessions
+ * carrying the same rdns, identity or ciphers don't each store their own.
+ */
+struct osmtpd_istr {
+	struct osmtpd_istr *next;
+	uint64_t hash;
+	size_t refcnt;
+	size_t len;
+	char str[];
+};
+#define OSMTPD_SESSION_SLAB 64
+
+/*
+ * Session strings are interned, the transaction strings live in msgarena
+ * and are released on tx-commit and tx-rollback. The first few recipients
+ * are kept in rcpt, larger lists are moved to a malloced vector which is
+ * kept until disconnect so following transactions can reuse it. rcptstatus
+ * runs parallel to ctx.rcptto.
+ */
 struct osmtpd_session {
 	struct osmtpd_ctx ctx;
-	RB_ENTRY(osmtpd_session) entry;
+	/* batchgc while awaiting free, sessionfree while unused */
+	SLIST_ENTRY(osmtpd_session) gc;
+	/* idlesessions of its direction, ordered by lastseen */
+	TAILQ_ENTRY(osmtpd_session) idle;
+	time_t lastseen;
+	/* The last client command was DATA, none are seen during a message */
+	int indata;
+	struct osmtpd_arena msgarena;
+	size_t nrcpt;
+	size_t rcptsz;
+	enum osmtpd_status *rcptstatus;
+	char *rcpt[4];
+	enum osmtpd_status rcptinstatus[4];
+	/* "reqid|token|" as last sent, reqid doesn't change */
+	char ids[34];
+	uint64_t idstoken;
+	int idsvalid;
+	/* Pending osmtpd_defer */
+	struct osmtpd_defer *defer;
+	/* Jobs of osmtpd_offload still referring to this session */
+	size_t noffload;
+	/* The filter event with token owedtoken waits for its filter-result */
+	int owed;
+	uint64_t owedtoken;
+	/* Bytes of memused held by the session itself */
+	size_t mem;
+	/* Grew past memlimit, transaction data isn't stored anymore */
+	int overlimit;
+	char msgarenabuf[256];
+};
+
+struct osmtpd_defer {
+	struct event ev;
+	enum osmtpd_status fallback;
+};
+
+struct osmtpd_worker {
+	pid_t pid;
+	int infd;
+	int outfd;
+	/* Lines for the worker and its output */
+	struct io *in;
+	struct io *out;
+	/* The worker's register lines have been passed or skipped */
+	int registered;
+	/* in went above shardhiwat and hasn't drained to shardlowat yet */
+	int infull;
+};
+
+struct osmtpd_job {
+	/* offloadq, protected by offloadmtx */
+	TAILQ_ENTRY(osmtpd_job) entry;
+	/* offloadjobs, only touched by the event loop */
+	TAILQ_ENTRY(osmtpd_job) inflight;
+	/* offloaddone */
+	struct osmtpd_job *next;
+	/* NULL once the session is gone */
+	struct osmtpd_session *session;
+	/* Of the event osmtpd_offload was called for, restored for done */
+	uint64_t token;
+	void (*work)(void *);
+	void (*done)(struct osmtpd_ctx *, void *);
+	void *arg;
+};
+
+/*
+ * The line currently being parsed. Fields are split in place by overwriting
+ * their separators with NUL. The overwritten characters are remembered, so
+ * the original line can be rebuilt when it needs to be reported.
+ */
+struct osmtpd_line {
+	char *buf;
+	size_t len;
+	size_t ncut;
+	struct {
+		size_t off;
+		char c;
+	} cut[16];
+};
+
+/*
+ * Output of osmtpd_message_fmt. It's reserved from io_out in chunks the
+ * size of the output queue's own, so they come from its freelist. todo is
+ * what is left to be reserved after buf.
+ */
+struct osmtpd_msgout {
+	char *buf;
+	size_t left;
+	size_t todo;
+	size_t chunk;
 };
 
 static void osmtpd_register(enum osmtpd_type, enum osmtpd_phase, int, int,
     void *);
 static const char *osmtpd_typetostr(enum osmtpd_type);
 static const char *osmtpd_phasetostr(enum osmtpd_phase);
-static enum osmtpd_phase osmtpd_strtophase(const char *, const char *);
+static void osmtpd_phasehash_init(void);
+static size_t osmtpd_phasehash_slot(const char *, size_t);
+static enum osmtpd_phase osmtpd_strtophase(const char *, size_t);
 static void osmtpd_newline(struct io *, int, void *);
 static void osmtpd_outevt(struct io *, int, void *);
+static char *osmtpd_field(char *, int);
+static void osmtpd_cut(char *);
+static const char *osmtpd_linedup(void);
+static int osmtpd_hextou64(char **, size_t, uint64_t *);
+static int osmtpd_dectou64(char **, size_t, uint64_t, uint64_t *);
+static uint32_t osmtpd_strtomsgid(char **, int);
 static void osmtpd_noargs(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_onearg(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
+static void osmtpd_dataline(struct osmtpd_callback *, struct osmtpd_ctx *,
+    char *);
 static void osmtpd_connect(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_identify(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_link_auth(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_link_connect(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_link_disconnect(struct osmtpd_callback *,
-    struct osmtpd_ctx *, char *, char *);
+    struct osmtpd_ctx *, char *);
 static void osmtpd_link_greeting(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_link_identify(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_link_tls(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_tx_begin(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_tx_mail(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_tx_rcpt(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_tx_envelope(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_tx_data(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_tx_commit(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
+    char *);
 static void osmtpd_tx_rollback(struct osmtpd_callback *, struct osmtpd_ctx *,
-    char *, char *);
-static void osmtpd_addrtoss(char *, struct sockaddr_storage *, int, char *);
-static enum osmtpd_status osmtpd_strtostatus(const char *, char *);
-static int osmtpd_session_cmp(struct osmtpd_session *, struct osmtpd_session *);
+    char *);
+static struct osmtpd_event *osmtpd_batch_add(struct osmtpd_ctx *);
+static void osmtpd_batch_flush(void);
+static struct osmtpd_session *osmtpd_session_alloc(void);
+static int osmtpd_session_reserve(enum osmtpd_type, enum osmtpd_phase,
+    uint64_t, char *);
+static void osmtpd_session_drop(struct osmtpd_session *);
+static void osmtpd_session_grow(struct osmtpd_session *, size_t);
+static void osmtpd_session_shrink(struct osmtpd_session *, size_t);
+static int osmtpd_session_evict(struct osmtpd_session *, size_t);
+static int osmtpd_session_busy(struct osmtpd_session *);
+static void osmtpd_session_free(struct osmtpd_session *);
+static time_t osmtpd_now(void);
+static void osmtpd_reap(int, short, void *);
+static void osmtpd_message_free(struct osmtpd_ctx *);
+static void osmtpd_rcpt_grow(struct osmtpd_session *);
+static uint64_t osmtpd_strhash(const char *, size_t);
+static const char *osmtpd_istr_get(const char *);
+static void osmtpd_istr_put(const char *);
+static void osmtpd_istr_set(const char **, const char *);
+static void osmtpd_arena_init(struct osmtpd_arena *, char *, size_t);
+static void *osmtpd_arena_alloc(struct osmtpd_arena *, size_t);
+static char *osmtpd_arena_strset(struct osmtpd_arena *, char *, const char *);
+static void osmtpd_arena_reset(struct osmtpd_arena *);
+static void osmtpd_setversion(const char *, size_t, int, int);
+static char *osmtpd_getpart(struct io *, char **, size_t *);
+static void osmtpd_dataline_part(const char *, size_t, int);
+static void osmtpd_outio(struct osmtpd_ctx *);
+static char *osmtpd_outprefix(struct osmtpd_ctx *, const char *, size_t);
+static const char *osmtpd_ids(struct osmtpd_ctx *);
+static int osmtpd_result(struct osmtpd_ctx *);
+static void osmtpd_defer_cancel(struct osmtpd_session *);
+static void osmtpd_defer_expire(int, short, void *);
+static void osmtpd_offload_start(void);
+static void osmtpd_offload_stop(void);
+static void *osmtpd_offload_worker(void *);
+static void osmtpd_offload_wakeup(void);
+static void osmtpd_offload_done(int, short, void *);
+static void osmtpd_offload_orphan(struct osmtpd_session *);
+static int osmtpd_shard(void);
+static void osmtpd_shard_run(void);
+static size_t osmtpd_shard_pick(char *, size_t);
+static void osmtpd_shard_newline(struct io *, int, void *);
+static void osmtpd_shard_inevt(struct io *, int, void *);
+static void osmtpd_shard_output(struct io *, int, void *);
+static void osmtpd_shard_forward(struct osmtpd_worker *);
+static void osmtpd_shard_outevt(struct io *, int, void *);
+static size_t osmtpd_message_fmt(struct osmtpd_msgout *, const char *,
+    size_t, const struct iovec *, int);
+static void osmtpd_message_emit(struct osmtpd_msgout *, size_t *,
+    const char *, size_t);
+static void osmtpd_hexenc(char *, uint64_t);
+static void osmtpd_outids_reqid(char *, struct osmtpd_ctx *);
+static void osmtpd_txaddr_status(char *, char *, char **,
+    enum osmtpd_status *);
+#ifndef NO_LEGACY_PROTOCOL
+static void osmtpd_outids_token(char *, struct osmtpd_ctx *);
+static void osmtpd_txaddr_legacy(char *, char *, char **,
+    enum osmtpd_status *);
+#endif
+static void osmtpd_addrtoss(char *, struct sockaddr_storage *, int);
+static enum osmtpd_status osmtpd_strtostatus(const char *);
+static struct osmtpd_session *osmtpd_session_find(uint64_t);
+static void osmtpd_session_insert(struct osmtpd_session *);
+static struct osmtpd_session *osmtpd_session_remove(uint64_t);
 static void *(*oncreatecb_session)(struct osmtpd_ctx *) = NULL;
 static void (*ondeletecb_session)(struct osmtpd_ctx *, void *) = NULL;
 static void *(*oncreatecb_message)(struct osmtpd_ctx *) = NULL;
 static void (*ondeletecb_message)(struct osmtpd_ctx *, void *) = NULL;
 static void (*conf_cb)(const char *, const char *);
+static void (*batch_cb)(struct osmtpd_event *, size_t) = NULL;
 
-static struct osmtpd_callback osmtpd_callbacks[] = {
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_CONNECT,
-	    1,
-	    osmtpd_connect,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_HELO,
-	    1,
-	    osmtpd_identify,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_EHLO,
-	    1,
-	    osmtpd_identify,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_STARTTLS,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_AUTH,
-	    1,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_MAIL_FROM,
-	    1,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_RCPT_TO,
-	    1,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_DATA,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_DATA_LINE,
-	    1,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_RSET,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_QUIT,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_NOOP,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_HELP,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_WIZ,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_FILTER,
-	    OSMTPD_PHASE_COMMIT,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-  	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_AUTH,
-	    1,
-	    osmtpd_link_auth,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_CONNECT,
-	    1,
-	    osmtpd_link_connect,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_DISCONNECT,
-	    1,
-	    osmtpd_link_disconnect,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_GREETING,
-	    1,
-	    osmtpd_link_greeting,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_IDENTIFY,
-	    1,
-	    osmtpd_link_identify,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_TLS,
-	    1,
-	    osmtpd_link_tls,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_BEGIN,
-	    1,
-	    osmtpd_tx_begin,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_MAIL,
-	    1,
-	    osmtpd_tx_mail,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_RCPT,
-	    1,
-	    osmtpd_tx_rcpt,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_ENVELOPE,
-	    1,
-	    osmtpd_tx_envelope,
-	    NULL,
-	    0,
-	   0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_DATA,
-	    1,
-	    osmtpd_tx_data,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_COMMIT,
-	    1,
-	    osmtpd_tx_commit,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_ROLLBACK,
-	    1,
-	    osmtpd_tx_rollback,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_PROTOCOL_CLIENT,
-	    1,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_PROTOCOL_SERVER,
-	    1,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_FILTER_RESPONSE,
-	    1,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TIMEOUT,
-	    1,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_CONNECT,
-	    0,
-	    osmtpd_link_connect,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_DISCONNECT,
-	    0,
-	    osmtpd_link_disconnect,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_GREETING,
-	    0,
-	    osmtpd_link_greeting,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_IDENTIFY,
-	    0,
-	    osmtpd_link_identify,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_LINK_TLS,
-	    0,
-	    osmtpd_link_tls,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_BEGIN,
-	    0,
-	    osmtpd_tx_begin,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_MAIL,
-	    0,
-	    osmtpd_tx_mail,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_RCPT,
-	    0,
-	    osmtpd_tx_rcpt,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_ENVELOPE,
-	    0,
-	    osmtpd_tx_envelope,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_DATA,
-	    0,
-	    osmtpd_tx_data,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_COMMIT,
-	    0,
-	    osmtpd_tx_commit,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TX_ROLLBACK,
-	    0,
-	    osmtpd_tx_rollback,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_PROTOCOL_CLIENT,
-	    0,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_PROTOCOL_SERVER,
-	    0,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
-	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_FILTER_RESPONSE,
-	    0,
-	    osmtpd_onearg,
-	    NULL,
-	    0,
-	    0
+/*
+ * Every phase of the protocol, in enum osmtpd_phase order, with the handler
+ * parsing it as a filter, as an incoming report and as an outgoing report.
+ * A NULL handler means the event doesn't exist.
+ */
+#define OSMTPD_PHASES							\
+	OSMTPD_PHASE(CONNECT, "connect", osmtpd_connect, NULL, NULL)	\
+	OSMTPD_PHASE(HELO, "helo", osmtpd_identify, NULL, NULL)		\
+	OSMTPD_PHASE(EHLO, "ehlo", osmtpd_identify, NULL, NULL)		\
+	OSMTPD_PHASE(STARTTLS, "starttls", osmtpd_noargs, NULL, NULL)	\
+	OSMTPD_PHASE(AUTH, "auth", osmtpd_onearg, NULL, NULL)		\
+	OSMTPD_PHASE(MAIL_FROM, "mail-from", osmtpd_onearg, NULL, NULL)	\
+	OSMTPD_PHASE(RCPT_TO, "rcpt-to", osmtpd_onearg, NULL, NULL)	\
+	OSMTPD_PHASE(DATA, "data", osmtpd_noargs, NULL, NULL)		\
+	OSMTPD_PHASE(DATA_LINE, "data-line", osmtpd_dataline,		\
+	    NULL, NULL)							\
+	OSMTPD_PHASE(RSET, "rset", osmtpd_noargs, NULL, NULL)		\
+	OSMTPD_PHASE(QUIT, "quit", osmtpd_noargs, NULL, NULL)		\
+	OSMTPD_PHASE(NOOP, "noop", osmtpd_noargs, NULL, NULL)		\
+	OSMTPD_PHASE(HELP, "help", osmtpd_noargs, NULL, NULL)		\
+	OSMTPD_PHASE(WIZ, "wiz", osmtpd_noargs, NULL, NULL)		\
+	OSMTPD_PHASE(COMMIT, "commit", osmtpd_noargs, NULL, NULL)	\
+	OSMTPD_PHASE(LINK_AUTH, "link-auth", NULL, osmtpd_link_auth, NULL) \
+	OSMTPD_PHASE(LINK_CONNECT, "link-connect", NULL,		\
+	    osmtpd_link_connect, osmtpd_link_connect)			\
+	OSMTPD_PHASE(LINK_DISCONNECT, "link-disconnect", NULL,		\
+	    osmtpd_link_disconnect, osmtpd_link_disconnect)		\
+	OSMTPD_PHASE(LINK_GREETING, "link-greeting", NULL,		\
+	    osmtpd_link_greeting, osmtpd_link_greeting)			\
+	OSMTPD_PHASE(LINK_IDENTIFY, "link-identify", NULL,		\
+	    osmtpd_link_identify, osmtpd_link_identify)			\
+	OSMTPD_PHASE(LINK_TLS, "link-tls", NULL,			\
+	    osmtpd_link_tls, osmtpd_link_tls)				\
+	OSMTPD_PHASE(TX_BEGIN, "tx-begin", NULL,			\
+	    osmtpd_tx_begin, osmtpd_tx_begin)				\
+	OSMTPD_PHASE(TX_MAIL, "tx-mail", NULL,				\
+	    osmtpd_tx_mail, osmtpd_tx_mail)				\
+	OSMTPD_PHASE(TX_RCPT, "tx-rcpt", NULL,				\
+	    osmtpd_tx_rcpt, osmtpd_tx_rcpt)				\
+	OSMTPD_PHASE(TX_ENVELOPE, "tx-envelope", NULL,			\
+	    osmtpd_tx_envelope, osmtpd_tx_envelope)			\
+	OSMTPD_PHASE(TX_DATA, "tx-data", NULL,				\
+	    osmtpd_tx_data, osmtpd_tx_data)				\
+	OSMTPD_PHASE(TX_COMMIT, "tx-commit", NULL,			\
+	    osmtpd_tx_commit, osmtpd_tx_commit)				\
+	OSMTPD_PHASE(TX_ROLLBACK, "tx-rollback", NULL,			\
+	    osmtpd_tx_rollback, osmtpd_tx_rollback)			\
+	OSMTPD_PHASE(PROTOCOL_CLIENT, "protocol-client", NULL,		\
+	    osmtpd_onearg, osmtpd_onearg)				\
+	OSMTPD_PHASE(PROTOCOL_SERVER, "protocol-server", NULL,		\
+	    osmtpd_onearg, osmtpd_onearg)				\
+	OSMTPD_PHASE(FILTER_RESPONSE, "filter-response", NULL,		\
+	    osmtpd_onearg, osmtpd_onearg)				\
+	OSMTPD_PHASE(TIMEOUT, "timeout", NULL,				\
+	    osmtpd_noargs, osmtpd_noargs)
+
+static const struct {
+	const char *name;
+	size_t len;
+} osmtpd_phases[] = {
+#define OSMTPD_PHASE(phase, name, filter, in, out)			\
+	[OSMTPD_PHASE_##phase] = { name, sizeof(name) - 1 },
+	OSMTPD_PHASES
+#undef OSMTPD_PHASE
+};
+
+#define OSMTPD_NPHASES NITEMS(osmtpd_phases)
+
+/* Indexed by [type][phase][incoming] */
+static struct osmtpd_callback
+    osmtpd_callbacks[OSMTPD_TYPE_REPORT + 1][OSMTPD_NPHASES][2] = {
+#define OSMTPD_PHASE(phase, name, filter, in, out)			\
+	[OSMTPD_TYPE_FILTER][OSMTPD_PHASE_##phase][1] = {		\
+	    OSMTPD_TYPE_FILTER, OSMTPD_PHASE_##phase, 1, filter		\
+	},								\
+	[OSMTPD_TYPE_REPORT][OSMTPD_PHASE_##phase][1] = {		\
+	    OSMTPD_TYPE_REPORT, OSMTPD_PHASE_##phase, 1, in		\
+	},								\
+	[OSMTPD_TYPE_REPORT][OSMTPD_PHASE_##phase][0] = {		\
+	    OSMTPD_TYPE_REPORT, OSMTPD_PHASE_##phase, 0, out		\
 	},
-	{
-	    OSMTPD_TYPE_REPORT,
-	    OSMTPD_PHASE_TIMEOUT,
-	    0,
-	    osmtpd_noargs,
-	    NULL,
-	    0,
-	    0
-	}
+	OSMTPD_PHASES
+#undef OSMTPD_PHASE
+};
+
+/*
+ * Perfect hash over the phase names, filled in by osmtpd_phasehash_init().
+ * Slots hold the phase + 1, so 0 marks an empty slot.
+ */
+#define OSMTPD_PHASEHASH_BITS 6
+static unsigned char osmtpd_phasehash[1 << OSMTPD_PHASEHASH_BITS];
+
+/* Value + 1 of every hex digit, 0 for anything else */
+static const unsigned char osmtpd_hexval[UCHAR_MAX + 1] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+static const long osmtpd_pow10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+	1000000000
 };
 
+static struct event_base *evbase = NULL;
+static struct io *io_stdin;
 static struct io *io_stdout;
+static struct osmtpd_line curline;
 static int needs;
 static int ready = 0;
 /* Default from smtpd */
 static int session_timeout = 300;
 
-RB_HEAD(osmtpd_sessions, osmtpd_session) osmtpd_sessions = RB_INITIALIZER(NULL);
-RB_PROTOTYPE_STATIC(osmtpd_sessions, osmtpd_session, entry, osmtpd_session_cmp);
+/*
+ * Every session has the same idle timeout, so keeping the sessions ordered
+ * by their last activity is enough to find the expired ones. Touching a
+ * session moves it to the tail and the reaper pops from the head. The
+ * smtp-session-timeout only applies to incoming sessions, which are kept
+ * apart from the outgoing ones, indexed by incoming. protocol-client is
+ * registered for them so every client command is seen, and they're evicted
+ * after twice the smtpd timeout without one.
+ */
+static TAILQ_HEAD(, osmtpd_session) idlesessions[2] = {
+	TAILQ_HEAD_INITIALIZER(idlesessions[0]),
+	TAILQ_HEAD_INITIALIZER(idlesessions[1])
+};
+static struct event reaper;
+static time_t now;
+static struct osmtpd_metrics metrics;
+static size_t outqsize, outqmaxfree;
+static int outqset = 0;
+
+/*
+ * Stop reading smtpd's events while more than outhiwat bytes of our own
+ * output are waiting, until the queue has drained to outlowat.
+ */
+static size_t outhiwat = 0, outlowat = 0;
+static int inpaused = 0;
+/* stdin is closed, the loop ends once the output is written */
+static int ineof = 0;
+
+/*
+ * The input buffer starts at insize bytes and doubles as needed up to
+ * inmax, the longest line a filter can be given.
+ */
+#define OSMTPD_INBUF_SIZE 65536
+#define OSMTPD_INBUF_MAX (1024 * 1024)
+static size_t insize = OSMTPD_INBUF_SIZE, inmax = OSMTPD_INBUF_MAX;
+
+/*
+ * A data-line longer than inmax is passed to the callback of inpart in
+ * parts. A data-line written in parts by outpart goes to io_stdout as it
+ * comes, output of other sessions is held back in io_hold until the line
+ * is complete. io_out is where the line being formatted goes.
+ */
+static struct osmtpd_session *inpart = NULL, *outpart = NULL;
+static struct io *io_hold = NULL, *io_out;
+
+/*
+ * osmtpd_offload: the event loop queues jobs on offloadq for the worker
+ * threads. Finished jobs are pushed on the lock-free offloaddone stack and
+ * the loop is woken through offloadfd, so done callbacks and everything
+ * they call only ever run in the loop thread.
+ */
+static pthread_mutex_t offloadmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t offloadcond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(, osmtpd_job) offloadq = TAILQ_HEAD_INITIALIZER(offloadq);
+static int offloadstop = 0;
+static TAILQ_HEAD(, osmtpd_job) offloadjobs =
+    TAILQ_HEAD_INITIALIZER(offloadjobs);
+static size_t noffloadjobs = 0;
+static _Atomic(struct osmtpd_job *) offloaddone = NULL;
+static int offloadfd[2] = {-1, -1};
+static struct event offloadev;
+static pthread_t *offloadthreads = NULL;
+static int noffloadthreads = 0;
+
+/*
+ * With osmtpd_workers the process forks nworkers workers, each running the
+ * regular event loop over its own pipes. The parent only reads the reqid
+ * of every line to pick the worker owning the session, and copies complete
+ * lines of worker output to stdout.
+ */
+static struct osmtpd_worker *workers = NULL;
+static size_t nworkers = 1, nworkersrunning = 0;
+static int isworker = 0, shardready = 0, shardeof = 0;
+/* Workers a line too long for the buffers is being passed on for, in parts */
+static struct osmtpd_worker *shardinpart = NULL, *shardoutpart = NULL;
+/*
+ * Reading from smtpd is paused while shardinfull workers have more than
+ * shardhiwat bytes of lines queued, reading from the workers while stdout
+ * has. Both resume once the queues have drained to shardlowat. These are
+ * the osmtpd_outwat watermarks, or OSMTPD_SHARD_HIWAT and half of it.
+ */
+#define OSMTPD_SHARD_HIWAT (1024 * 1024)
+static size_t shardhiwat, shardlowat, shardinfull = 0;
+static int shardoutpaused = 0;
+
+/*
+ * Bytes used by live sessions: the session itself, the arena overflow
+ * blocks, the recipient vectors and deferrals, which are also accounted to
+ * the session in its mem, and the interned strings, which are shared.
+ * Checked against memlimit whenever a new session is about to be created
+ * and whenever a session grows. memgc holds the bytes of sessions on
+ * batchgc, which are as good as freed.
+ */
+static size_t memlimit = 0, memused = 0, memgc = 0;
+static int memlimit_policy = OSMTPD_MEMLIMIT_TEMPFAIL;
+
+/* Chained hash table of interned strings, sized to a power of two */
+static struct osmtpd_istr **istrs = NULL;
+static size_t istrsmask = 0, nistrs = 0;
+
+/*
+ * The protocol version doesn't change during the lifetime of the process.
+ * It is taken from the first line, which also selects the version specific
+ * parts of parsing and output. Later lines only compare the version string.
+ */
+static char version[16];
+static size_t versionlen = 0;
+static int version_major, version_minor;
+/* Format "reqid|token|" in the order the protocol version expects */
+static void (*osmtpd_outids)(char *, struct osmtpd_ctx *);
+/* Split the address and status fields of tx-mail and tx-rcpt */
+static void (*osmtpd_txaddr)(char *, char *, char **, enum osmtpd_status *);
+
+/*
+ * Report events waiting for batch_cb. batchev is the event the line being
+ * parsed is stored in, or NULL if the line is dispatched directly.
+ * Sessions disconnected while events still refer to them are kept on
+ * batchgc until the batch is delivered.
+ */
+static struct osmtpd_event *batch;
+static size_t nbatch, batchsz;
+static struct osmtpd_event *batchev;
+static SLIST_HEAD(, osmtpd_session) batchgc = SLIST_HEAD_INITIALIZER(batchgc);
+static SLIST_HEAD(, osmtpd_session) sessionfree =
+    SLIST_HEAD_INITIALIZER(sessionfree);
+
+/*
+ * Sessions by reqid, in an open addressing hash table with Robin Hood
+ * probing. The size is a power of two, an empty slot has no session.
+ * Lines tend to arrive in runs for the same session, so the last session
+ * found is checked first.
+ */
+struct osmtpd_sessionslot {
+	uint64_t reqid;
+	struct osmtpd_session *session;
+};
+static struct osmtpd_sessionslot *sessions = NULL;
+static size_t sessionsmask = 0, nsessions = 0;
+static int sessionsshift;
+static struct osmtpd_session *lastsession = NULL;
 
 void
 osmtpd_register_conf(void (*cb)(const char *, const char *))
@@ -639,6 +666,21 @@ osmtpd_register_filter_dataline(void (*cb)(struct osmtpd_ctx *, const char *))
 	    NULL);
 }
 
+void
+osmtpd_register_filter_dataline_part(void (*cb)(struct osmtpd_ctx *,
+    const char *, size_t, int))
+{
+	struct osmtpd_callback *callback;
+
+	osmtpd_register(OSMTPD_TYPE_FILTER, OSMTPD_PHASE_DATA_LINE, 1, 0,
+	    (void *)cb);
+	callback = &(osmtpd_callbacks[OSMTPD_TYPE_FILTER]
+	    [OSMTPD_PHASE_DATA_LINE][1]);
+	callback->part = 1;
+	osmtpd_register(OSMTPD_TYPE_REPORT, OSMTPD_PHASE_LINK_DISCONNECT, 1, 0,
+	    NULL);
+}
+
 void
 osmtpd_register_filter_rset(void (*cb)(struct osmtpd_ctx *))
 {
@@ -850,6 +892,30 @@ osmtpd_register_report_auth(int incoming, void (*cb)(struct osmtpd_ctx *,
 	    incoming, 0, NULL);
 }
 
+void
+osmtpd_register_report_batch(int incoming, enum osmtpd_phase phase)
+{
+	struct osmtpd_callback *callback;
+
+	/* Make src and dst available through ctx */
+	osmtpd_register(OSMTPD_TYPE_REPORT, phase, incoming,
+	    phase == OSMTPD_PHASE_LINK_CONNECT, NULL);
+	callback = &(osmtpd_callbacks[OSMTPD_TYPE_REPORT][phase][incoming]);
+	if (callback->cb != NULL)
+		osmtpd_errx(1, "Event already registered");
+	callback->batch = 1;
+	osmtpd_register(OSMTPD_TYPE_REPORT, OSMTPD_PHASE_LINK_DISCONNECT,
+	    incoming, 0, NULL);
+}
+
+void
+osmtpd_register_batch(void (*cb)(struct osmtpd_event *, size_t))
+{
+	if (ready)
+		osmtpd_errx(1, "Can't register when proc is running");
+	batch_cb = cb;
+}
+
 void
 osmtpd_local_session(void *(*oncreate)(struct osmtpd_ctx *),
     void (*ondelete)(struct osmtpd_ctx *, void *))
@@ -921,25 +987,68 @@ osmtpd_register_need(int incoming)
 		    incoming, 0, NULL);
 	}
 
+	/* Every client command counts as activity for osmtpd_reap */
+	if (incoming)
+		osmtpd_register(OSMTPD_TYPE_REPORT,
+		    OSMTPD_PHASE_PROTOCOL_CLIENT, incoming, 0, NULL);
+
 	osmtpd_register(OSMTPD_TYPE_REPORT, OSMTPD_PHASE_LINK_DISCONNECT,
 	    incoming, 0, NULL);
 }
 
+/*
+ * The base is also libevent's current base, so filters using the global
+ * event_set/event_add API, like event_asr_run, keep working.
+ */
+struct event_base *
+osmtpd_event_base(void)
+{
+	if (evbase != NULL)
+		return evbase;
+
+	if ((evbase = event_init()) == NULL)
+		osmtpd_errx(1, "Failed to create event base");
+	io_set_evbase(evbase);
+	return evbase;
+}
+
+void
+osmtpd_add_fd(struct event *ev, int fd, short events,
+    void (*cb)(int, short, void *), void *arg)
+{
+	event_set(ev, fd, events, cb, arg);
+	if (event_base_set(osmtpd_event_base(), ev) == -1 ||
+	    event_add(ev, NULL) == -1)
+		osmtpd_errx(1, "Failed to add event");
+}
+
+void
+osmtpd_add_timer(struct event *ev, const struct timeval *tv,
+    void (*cb)(int, short, void *), void *arg)
+{
+	evtimer_set(ev, cb, arg);
+	if (event_base_set(osmtpd_event_base(), ev) == -1 ||
+	    evtimer_add(ev, tv) == -1)
+		osmtpd_errx(1, "Failed to add timer");
+}
+
 void
 osmtpd_run(void)
 {
-	size_t i = 0;
-	int registered = 0;
-	struct event_base *evbase;
-	struct io *io_stdin;
-	struct osmtpd_callback *hidenity = NULL, *eidentity = NULL;
-	struct osmtpd_callback *ridentity = NULL;
+	size_t type, phase;
+	int incoming, registered = 0;
+	struct osmtpd_callback *callback, *hidenity, *eidentity, *ridentity;
+
+	if (nworkers > 1 && osmtpd_shard())
+		return;
 
-	evbase = event_init();
+	osmtpd_event_base();
 
 	if ((io_stdin = io_new()) == NULL ||
 	    (io_stdout = io_new()) == NULL)
 		osmtpd_err(1, "io_new");
+	if (io_set_rbuf(io_stdin, insize, inmax) == -1)
+		osmtpd_err(1, "io_set_rbuf");
 	io_set_nonblocking(STDIN_FILENO);
 	io_set_fd(io_stdin, STDIN_FILENO);
 	io_set_callback(io_stdin, osmtpd_newline, NULL);
@@ -948,48 +1057,69 @@ osmtpd_run(void)
 	io_set_fd(io_stdout, STDOUT_FILENO);
 	io_set_callback(io_stdout, osmtpd_outevt, NULL);
 	io_set_write(io_stdout);
-
-	for (i = 0; i < NITEMS(osmtpd_callbacks); i++) {
-		if (osmtpd_callbacks[i].doregister) {
-			osmtpd_register_need(osmtpd_callbacks[i].incoming);
-			if (oncreatecb_message != NULL) {
+	if (outqset)
+		io_set_qbuf(io_stdout, outqsize, outqmaxfree);
+	io_set_lowat(io_stdout, outlowat);
+#ifdef IO_URING
+	/* Stays on libevent when the kernel has no usable io_uring */
+	(void)io_set_ring(io_stdin);
+	(void)io_set_ring(io_stdout);
+#endif
+	evtimer_set(&reaper, osmtpd_reap, NULL);
+	event_base_set(evbase, &reaper);
+
+	osmtpd_phasehash_init();
+
+	for (type = 0; type < NITEMS(osmtpd_callbacks); type++) {
+		for (incoming = 1; incoming >= 0; incoming--) {
+			for (phase = 0; phase < OSMTPD_NPHASES; phase++) {
+				callback =
+				    &(osmtpd_callbacks[type][phase][incoming]);
+				if (!callback->doregister)
+					continue;
+				osmtpd_register_need(incoming);
+				if (oncreatecb_message == NULL)
+					continue;
 				osmtpd_register(OSMTPD_TYPE_REPORT,
-				    OSMTPD_PHASE_TX_BEGIN,
-				    osmtpd_callbacks[i].incoming, 0, NULL);
+				    OSMTPD_PHASE_TX_BEGIN, incoming, 0, NULL);
 				osmtpd_register(OSMTPD_TYPE_REPORT,
-				    OSMTPD_PHASE_TX_ROLLBACK,
-				    osmtpd_callbacks[i].incoming, 0, NULL);
+				    OSMTPD_PHASE_TX_ROLLBACK, incoming, 0,
+				    NULL);
 				osmtpd_register(OSMTPD_TYPE_REPORT,
-				    OSMTPD_PHASE_TX_COMMIT,
-				    osmtpd_callbacks[i].incoming, 0, NULL);
+				    OSMTPD_PHASE_TX_COMMIT, incoming, 0, NULL);
 			}
-			if (osmtpd_callbacks[i].type == OSMTPD_TYPE_FILTER &&
-			    osmtpd_callbacks[i].phase == OSMTPD_PHASE_HELO)
-				hidenity = &(osmtpd_callbacks[i]);
-			if (osmtpd_callbacks[i].type == OSMTPD_TYPE_FILTER &&
-			    osmtpd_callbacks[i].phase == OSMTPD_PHASE_EHLO)
-				eidentity = &(osmtpd_callbacks[i]);
-			if (osmtpd_callbacks[i].type == OSMTPD_TYPE_REPORT &&
-			    osmtpd_callbacks[i].phase ==
-			    OSMTPD_PHASE_LINK_IDENTIFY &&
-			    osmtpd_callbacks[i].incoming == 1)
-				ridentity = &(osmtpd_callbacks[i]);
 		}
 	}
-	if (ridentity != NULL && ridentity->storereport) {
-		if (hidenity != NULL && hidenity->doregister)
+	ridentity = &(osmtpd_callbacks[OSMTPD_TYPE_REPORT]
+	    [OSMTPD_PHASE_LINK_IDENTIFY][1]);
+	if (ridentity->doregister && ridentity->storereport) {
+		hidenity = &(osmtpd_callbacks[OSMTPD_TYPE_FILTER]
+		    [OSMTPD_PHASE_HELO][1]);
+		eidentity = &(osmtpd_callbacks[OSMTPD_TYPE_FILTER]
+		    [OSMTPD_PHASE_EHLO][1]);
+		if (hidenity->doregister)
 			hidenity->storereport = 1;
-		if (eidentity != NULL && eidentity->doregister)
+		if (eidentity->doregister)
 			eidentity->storereport = 1;
 	}
-	for (i = 0; i < NITEMS(osmtpd_callbacks); i++) {
-		if (osmtpd_callbacks[i].doregister) {
-			if (osmtpd_callbacks[i].cb != NULL)
-				registered = 1;
-			io_printf(io_stdout, "register|%s|smtp-%s|%s\n",
-			    osmtpd_typetostr(osmtpd_callbacks[i].type),
-			    osmtpd_callbacks[i].incoming ? "in" : "out",
-			    osmtpd_phasetostr(osmtpd_callbacks[i].phase));
+	for (type = 0; type < NITEMS(osmtpd_callbacks); type++) {
+		for (incoming = 1; incoming >= 0; incoming--) {
+			for (phase = 0; phase < OSMTPD_NPHASES; phase++) {
+				callback =
+				    &(osmtpd_callbacks[type][phase][incoming]);
+				if (!callback->doregister)
+					continue;
+				if (callback->batch && batch_cb == NULL)
+					osmtpd_errx(1, "Batch events "
+					    "registered without callback");
+				if (callback->cb != NULL || callback->batch)
+					registered = 1;
+				io_printf(io_stdout,
+				    "register|%s|smtp-%s|%s\n",
+				    osmtpd_typetostr(type),
+				    incoming ? "in" : "out",
+				    osmtpd_phasetostr(phase));
+			}
 		}
 	}
 
@@ -998,170 +1128,604 @@ osmtpd_run(void)
 	io_printf(io_stdout, "register|ready\n");
 	ready = 1;
 
-	event_dispatch();
+	event_base_dispatch(evbase);
+	osmtpd_offload_stop();
+	/* Keep the io counters in metrics once the io are gone */
+	osmtpd_metrics();
 	io_free(io_stdin);
 	io_free(io_stdout);
+	io_stdin = io_stdout = NULL;
+	if (io_hold != NULL) {
+		io_free(io_hold);
+		io_hold = NULL;
+	}
+	io_set_evbase(NULL);
 	event_base_free(evbase);
+	evbase = NULL;
+	if (isworker)
+		exit(0);
 }
 
-__dead void
-osmtpd_err(int eval, const char *fmt, ...)
+void
+osmtpd_workers(int n)
 {
-	va_list ap;
+	if (n < 1)
+		osmtpd_errx(1, "Invalid number of workers");
+	nworkers = n;
+}
 
-	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
-	va_end(ap);
-	fprintf(stderr, ": %s\n", strerror(errno));
-	exit(eval);
+/*
+ * Fork the workers. Returns 0 in the workers, which continue as a regular
+ * filter on the pipes set up as stdin and stdout, and 1 in the parent once
+ * all workers are done.
+ */
+static int
+osmtpd_shard(void)
+{
+	int in[2], out[2];
+	size_t i, j;
+	pid_t pid;
+
+	if ((workers = calloc(nworkers, sizeof(*workers))) == NULL)
+		osmtpd_err(1, NULL);
+	for (i = 0; i < nworkers; i++) {
+		if (pipe(in) == -1 || pipe(out) == -1)
+			osmtpd_err(1, "pipe");
+		if ((pid = fork()) == -1)
+			osmtpd_err(1, "fork");
+		if (pid == 0) {
+			for (j = 0; j < i; j++) {
+				close(workers[j].infd);
+				close(workers[j].outfd);
+			}
+			free(workers);
+			workers = NULL;
+			if (dup2(in[0], STDIN_FILENO) == -1 ||
+			    dup2(out[1], STDOUT_FILENO) == -1)
+				osmtpd_err(1, "dup2");
+			close(in[0]);
+			close(in[1]);
+			close(out[0]);
+			close(out[1]);
+			if (evbase != NULL && event_reinit(evbase) == -1)
+				osmtpd_errx(1, "event_reinit");
+			isworker = 1;
+			return 0;
+		}
+		close(in[0]);
+		close(out[1]);
+		workers[i].pid = pid;
+		workers[i].infd = in[1];
+		workers[i].outfd = out[0];
+	}
+
+	/* Events added before osmtpd_run belong to the workers */
+	if (evbase != NULL) {
+		io_set_evbase(NULL);
+		event_base_free(evbase);
+		evbase = NULL;
+	}
+	osmtpd_shard_run();
+	return 1;
 }
 
-__dead void
-osmtpd_errx(int eval, const char *fmt, ...)
+static void
+osmtpd_shard_run(void)
 {
-	va_list ap;
+	struct osmtpd_worker *worker;
+	size_t i;
 
-	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
-	va_end(ap);
-	fprintf(stderr, "\n");
-	exit(eval);
+	signal(SIGPIPE, SIG_IGN);
+	osmtpd_event_base();
+
+	if (outhiwat != 0) {
+		shardhiwat = outhiwat;
+		shardlowat = outlowat;
+	} else {
+		shardhiwat = OSMTPD_SHARD_HIWAT;
+		shardlowat = OSMTPD_SHARD_HIWAT / 2;
+	}
+
+	if ((io_stdin = io_new()) == NULL ||
+	    (io_stdout = io_new()) == NULL)
+		osmtpd_err(1, "io_new");
+	if (io_set_rbuf(io_stdin, insize, inmax) == -1)
+		osmtpd_err(1, "io_set_rbuf");
+	io_set_nonblocking(STDIN_FILENO);
+	io_set_fd(io_stdin, STDIN_FILENO);
+	io_set_callback(io_stdin, osmtpd_shard_newline, NULL);
+	io_set_read(io_stdin);
+	io_set_nonblocking(STDOUT_FILENO);
+	io_set_fd(io_stdout, STDOUT_FILENO);
+	io_set_callback(io_stdout, osmtpd_shard_outevt, NULL);
+	io_set_write(io_stdout);
+	io_set_lowat(io_stdout, shardlowat);
+	if (outqset)
+		io_set_qbuf(io_stdout, outqsize, outqmaxfree);
+
+	for (i = 0; i < nworkers; i++) {
+		worker = &(workers[i]);
+		if ((worker->in = io_new()) == NULL ||
+		    (worker->out = io_new()) == NULL)
+			osmtpd_err(1, "io_new");
+		if (io_set_rbuf(worker->out, insize, inmax) == -1)
+			osmtpd_err(1, "io_set_rbuf");
+		io_set_nonblocking(worker->infd);
+		io_set_fd(worker->in, worker->infd);
+		io_set_callback(worker->in, osmtpd_shard_inevt, worker);
+		io_set_write(worker->in);
+		io_set_lowat(worker->in, shardlowat);
+		io_set_nonblocking(worker->outfd);
+		io_set_fd(worker->out, worker->outfd);
+		io_set_callback(worker->out, osmtpd_shard_output, worker);
+		io_set_read(worker->out);
+	}
+	nworkersrunning = nworkers;
+
+	event_base_dispatch(evbase);
+
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].in != NULL)
+			io_free(workers[i].in);
+		if (workers[i].out != NULL)
+			io_free(workers[i].out);
+		waitpid(workers[i].pid, NULL, 0);
+	}
+	free(workers);
+	workers = NULL;
+	if (io_stdin != NULL)
+		io_free(io_stdin);
+	io_free(io_stdout);
+	io_stdin = io_stdout = NULL;
+	io_set_evbase(NULL);
+	event_base_free(evbase);
+	evbase = NULL;
+}
+
+/* A session always maps to the same worker, keeping its events in order */
+static size_t
+osmtpd_shard_pick(char *line, size_t len)
+{
+	char *end = line + len;
+	uint64_t reqid;
+	int i;
+
+	/* type|version|timestamp|subsystem|phase|reqid */
+	for (i = 0; i < 5; i++) {
+		if ((line = memchr(line, '|', end - line)) == NULL)
+			return 0;
+		line++;
+	}
+	/* Lines may be parts, which aren't NUL terminated */
+	if (end - line < 16 || osmtpd_hextou64(&line, 16, &reqid) == -1)
+		return 0;
+	return ((reqid * 0x9e3779b97f4a7c15ULL) >> 32) % nworkers;
 }
 
 static void
-osmtpd_newline(struct io *io, int ev, __unused void *arg)
+osmtpd_shard_newline(struct io *io, int ev, __unused void *arg)
 {
-	static char *linedup = NULL;
-	static size_t dupsize = 0;
-	struct osmtpd_session *ctx, search;
-	enum osmtpd_type type;
-	enum osmtpd_phase phase;
-	int version_major, version_minor, incoming;
-	struct timespec tm;
-	char *line = NULL;
-	const char *errstr = NULL;
-	size_t linelen;
-	char *end;
-	size_t i;
+	struct osmtpd_worker *worker;
+	char *line;
+	size_t linelen, i;
 
 	if (ev == IO_DISCONNECTED) {
-		event_loopexit(0);
+		io_free(io);
+		io_stdin = NULL;
+		shardeof = 1;
+		/* Close the pipes once the workers have all their lines */
+		for (i = 0; i < nworkers; i++) {
+			worker = &(workers[i]);
+			if (io_queued(worker->in) == 0) {
+				io_free(worker->in);
+				worker->in = NULL;
+			} else
+				io_set_lowat(worker->in, 0);
+		}
 		return;
 	}
 	if (ev != IO_DATAIN)
 		return;
-	/*
-	 * Multiple calls to io_printf (through osmtpd_filter_dataline) can
-	 * cause a build-up of kevents, because of event_add/event_del loop.
-	 */
-	io_pause(io_stdout, IO_OUT);
+
 	while ((line = io_getline(io, &linelen)) != NULL) {
-		if (dupsize < linelen) {
-			if ((linedup = realloc(linedup, linelen + 1)) == NULL)
-				osmtpd_err(1, NULL);
-			dupsize = linelen + 1;
-		}
-		strlcpy(linedup, line, dupsize);
-		if ((end = strchr(line, '|')) == NULL)
-			osmtpd_errx(1, "Invalid line received: missing "
-			    "version: %s", linedup);
-		end++[0] = '\0';
-		if (strcmp(line, "filter") == 0)
-			type = OSMTPD_TYPE_FILTER;
-		else if (strcmp(line, "report") == 0)
-			type = OSMTPD_TYPE_REPORT;
-		else if (strcmp(line, "config") == 0) {
-			line = end;
-			if (strcmp(line, "ready") == 0) {
-				if (conf_cb != NULL)
-					conf_cb(NULL, NULL);
-				continue;
-			}
-			if ((end = strchr(line, '|')) == NULL)
-				osmtpd_errx(1, "Invalid line received: missing "
-				    "key: %s", linedup);
-			end++[0] = '\0';
-			if (conf_cb != NULL)
-				conf_cb(line, end);
-			if (strcmp(line, "smtp-session-timeout") == 0) {
-				session_timeout = strtonum(end, 0, INT_MAX,
-				    &errstr);
-				if (errstr != NULL)
-					osmtpd_errx(1, "Invalid line received: "
-					    "invalid smtp-sesion-timeout: %s",
-					    linedup);
+		if (!shardready) {
+			/* Every worker needs the configuration */
+			for (i = 0; i < nworkers; i++) {
+				io_write(workers[i].in, line, linelen);
+				io_write(workers[i].in, "\n", 1);
 			}
+			if (strcmp(line, "config|ready") == 0)
+				shardready = 1;
 			continue;
 		}
-		else
-			osmtpd_errx(1, "Invalid line received: unknown message "
-			    "type: %s", linedup);
-		line = end;
-		version_major = strtoul(line, &end, 10);
-		if (line == end || end[0] != '.')
-			osmtpd_errx(1, "Invalid protocol received: %s",
-			    linedup);
-		line = end + 1;
-		version_minor = strtoul(line, &end, 10);
-		if (end[0] == '\0')
-			osmtpd_errx(1, "Invalid line received: missing time: "
-			    "%s", linedup);
-		if (line == end || end[0] != '|')
-			osmtpd_errx(1, "Invalid protocol received: %s",
-			    linedup);
-		if (version_major != 0)
-			osmtpd_errx(1, "Unsupported protocol received: %s",
-			    linedup);
-		line = end + 1;
-		if ((end = strchr(line, '.')) == NULL)
-			osmtpd_errx(1, "Invalid line received: invalid "
-			    "timestamp: %s", linedup);
-		end++[0] = '\0';
-		tm.tv_sec = (time_t) strtonum(line, 0, INT64_MAX, &errstr);
-		if (errstr != NULL)
-			osmtpd_errx(1, "Invalid line received: invalid "
-			    "timestamp: %s", linedup);
-		line = end;
-		if ((end = strchr(line, '|')) == NULL)
-			osmtpd_errx(1, "Invalid line received: missing "
-			    "direction: %s", linedup);
-		end++[0] = '\0';
-		tm.tv_nsec = (long) strtonum(line, 0, LONG_MAX, &errstr);
-		if (errstr != NULL)
-			osmtpd_errx(1, "Invalid line received: invalid "
-			    "timestamp: %s", linedup);
-		tm.tv_nsec *= 10 * (9 - (end - line));
-		line = end;
-		if ((end = strchr(line, '|')) == NULL)
+		if (shardinpart != NULL) {
+			/* The end of a line passed on in parts */
+			worker = shardinpart;
+			shardinpart = NULL;
+		} else
+			worker = &(workers[osmtpd_shard_pick(line, linelen)]);
+		line[linelen] = '\n';
+		io_write(worker->in, line, linelen + 1);
+	}
+
+	/* A line too long for the buffer is passed on in parts */
+	if ((line = io_getpart(io, &linelen)) != NULL) {
+		if (!shardready)
+			osmtpd_errx(1, "Invalid line received: configuration "
+			    "line too long");
+		if (shardinpart == NULL)
+			shardinpart =
+			    &(workers[osmtpd_shard_pick(line, linelen)]);
+		io_write(shardinpart->in, line, linelen);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		worker = &(workers[i]);
+		if (!worker->infull && io_queued(worker->in) > shardhiwat) {
+			worker->infull = 1;
+			shardinfull++;
+		}
+	}
+	if (shardinfull != 0 && !inpaused) {
+		io_pause(io, IO_IN);
+		inpaused = 1;
+		metrics.input_pauses++;
+	}
+}
+
+static void
+osmtpd_shard_inevt(struct io *io, int evt, void *arg)
+{
+	struct osmtpd_worker *worker = arg;
+
+	switch (evt) {
+	case IO_LOWAT:
+		if (shardeof) {
+			if (io_queued(io) == 0) {
+				io_free(io);
+				worker->in = NULL;
+			}
+			return;
+		}
+		if (worker->infull) {
+			worker->infull = 0;
+			if (--shardinfull == 0 && inpaused) {
+				io_resume(io_stdin, IO_IN);
+				inpaused = 0;
+			}
+		}
+		return;
+	case IO_DISCONNECTED:
+	case IO_ERROR:
+		osmtpd_errx(1, "Worker %zu exited", (size_t)(worker - workers));
+	default:
+		osmtpd_errx(1, "Unexpectd event");
+	}
+}
+
+static void
+osmtpd_shard_output(struct io *io, int evt, void *arg)
+{
+	struct osmtpd_worker *worker = arg;
+	char *line;
+	size_t len, i;
+
+	switch (evt) {
+	case IO_DATAIN:
+		break;
+	case IO_DISCONNECTED:
+		if (!shardeof)
+			osmtpd_errx(1, "Worker %zu exited",
+			    (size_t)(worker - workers));
+		/* Pass on what is left, only a line cut short is lost */
+		osmtpd_shard_forward(worker);
+		if (io_datalen(io) != 0 || shardoutpart == worker)
+			osmtpd_errx(1, "Worker %zu exited within a line",
+			    (size_t)(worker - workers));
+		io_free(io);
+		worker->out = NULL;
+		if (--nworkersrunning == 0) {
+			if (io_queued(io_stdout) == 0)
+				event_base_loopexit(evbase, NULL);
+			else
+				io_set_lowat(io_stdout, 0);
+		}
+		return;
+	default:
+		osmtpd_errx(1, "Worker %zu failed", (size_t)(worker - workers));
+	}
+
+	/* smtpd must only see the registration of a single worker */
+	while (!worker->registered &&
+	    (line = io_getline(io, &len)) != NULL) {
+		if (strcmp(line, "register|ready") == 0)
+			worker->registered = 1;
+		if (worker == workers) {
+			line[len] = '\n';
+			io_write(io_stdout, line, len + 1);
+		}
+	}
+
+	osmtpd_shard_forward(worker);
+
+	if (!shardoutpaused && io_queued(io_stdout) > shardhiwat) {
+		shardoutpaused = 1;
+		for (i = 0; i < nworkers; i++) {
+			if (workers[i].out != NULL)
+				io_pause(workers[i].out, IO_IN);
+		}
+	}
+}
+
+/*
+ * Only pass complete lines, so workers don't mix within a line. A line too
+ * long for the buffer is passed on in parts, and the other workers are held
+ * back until it is complete.
+ */
+static void
+osmtpd_shard_forward(struct osmtpd_worker *worker)
+{
+	struct io *io = worker->out;
+	char *data, *nl;
+	size_t len, i;
+
+	if (shardoutpart != NULL && shardoutpart != worker)
+		return;
+
+	data = io_data(io);
+	len = io_datalen(io);
+	if (shardoutpart == worker) {
+		if ((nl = memchr(data, '\n', len)) == NULL) {
+			io_write(io_stdout, data, len);
+			io_drop(io, len);
+			return;
+		}
+		len = nl - data + 1;
+		io_write(io_stdout, data, len);
+		io_drop(io, len);
+		shardoutpart = NULL;
+		for (i = 0; i < nworkers && shardoutpart == NULL; i++) {
+			if (&(workers[i]) == worker || workers[i].out == NULL)
+				continue;
+			if (!shardoutpaused)
+				io_resume(workers[i].out, IO_IN);
+			osmtpd_shard_forward(&(workers[i]));
+		}
+		/* Another worker is now passing on a line in parts */
+		if (shardoutpart != NULL)
+			return;
+		data = io_data(io);
+		len = io_datalen(io);
+	}
+
+	if ((nl = memrchr(data, '\n', len)) != NULL) {
+		len = nl - data + 1;
+		io_write(io_stdout, data, len);
+		io_drop(io, len);
+	}
+
+	if ((data = io_getpart(io, &len)) != NULL) {
+		shardoutpart = worker;
+		for (i = 0; i < nworkers; i++) {
+			if (&(workers[i]) != worker && workers[i].out != NULL)
+				io_pause(workers[i].out, IO_IN);
+		}
+		io_write(io_stdout, data, len);
+	}
+}
+
+static void
+osmtpd_shard_outevt(struct io *io, int evt, __unused void *arg)
+{
+	size_t i;
+
+	switch (evt) {
+	case IO_LOWAT:
+		if (shardeof && nworkersrunning == 0) {
+			if (io_queued(io) == 0)
+				event_base_loopexit(evbase, NULL);
+			return;
+		}
+		if (shardoutpaused) {
+			shardoutpaused = 0;
+			/* Unless held back by a line passed on in parts */
+			for (i = 0; i < nworkers; i++) {
+				if (workers[i].out != NULL &&
+				    (shardoutpart == NULL ||
+				    shardoutpart == &(workers[i])))
+					io_resume(workers[i].out, IO_IN);
+			}
+		}
+		return;
+	case IO_DISCONNECTED:
+		exit(0);
+	default:
+		osmtpd_errx(1, "Unexpectd event");
+	}
+}
+
+__dead void
+osmtpd_err(int eval, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, ": %s\n", strerror(errno));
+	exit(eval);
+}
+
+__dead void
+osmtpd_errx(int eval, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(eval);
+}
+
+static void
+osmtpd_newline(struct io *io, int ev, __unused void *arg)
+{
+	struct osmtpd_session *ctx;
+	struct osmtpd_callback *callback;
+	enum osmtpd_type type;
+	enum osmtpd_phase phase;
+	int major, incoming;
+	struct timespec tm;
+	struct timeval tv;
+	char *line = NULL, *part = NULL;
+	const char *errstr = NULL;
+	struct iobuf_line lines[64];
+	uint64_t num, reqid;
+	size_t linelen, partlen = 0, nlines = 0, n = 0;
+	char *base, *end;
+
+	if (ev == IO_DISCONNECTED) {
+		/* Write out what is queued, the parent of a worker wants it */
+		if (io_queued(io_stdout) != 0) {
+			io_pause(io, IO_IN);
+			io_set_lowat(io_stdout, 0);
+			ineof = 1;
+			return;
+		}
+		event_base_loopexit(evbase, NULL);
+		return;
+	}
+	/* Also a line longer than the input buffer can grow */
+	if (ev == IO_ERROR)
+		osmtpd_errx(1, "Failed to read from smtpd: %s", io_error(io));
+	if (ev != IO_DATAIN)
+		return;
+	now = osmtpd_now();
+	/* Write all responses to this batch of lines at once */
+	io_cork(io_stdout);
+	for (;;) {
+		if (n == nlines) {
+			nlines = io_getlines(io, lines, NITEMS(lines), &base);
+			n = 0;
+		}
+		if (n != nlines) {
+			line = base + lines[n].off;
+			linelen = lines[n++].len;
+			/* The end of a data-line received in parts */
+			if (inpart != NULL) {
+				osmtpd_dataline_part(line, linelen, 0);
+				continue;
+			}
+		} else if ((line = osmtpd_getpart(io, &part, &partlen)) != NULL)
+			linelen = strlen(line);
+		else
+			break;
+		curline.buf = line;
+		curline.len = linelen;
+		curline.ncut = 0;
+		if ((end = osmtpd_field(line, '|')) == NULL)
+			osmtpd_errx(1, "Invalid line received: missing "
+			    "version: %s", osmtpd_linedup());
+		if (strcmp(line, "filter") == 0)
+			type = OSMTPD_TYPE_FILTER;
+		else if (strcmp(line, "report") == 0)
+			type = OSMTPD_TYPE_REPORT;
+		else if (strcmp(line, "config") == 0) {
+			line = end;
+			if (strcmp(line, "ready") == 0) {
+				if (conf_cb != NULL)
+					conf_cb(NULL, NULL);
+				continue;
+			}
+			if ((end = osmtpd_field(line, '|')) == NULL)
+				osmtpd_errx(1, "Invalid line received: missing "
+				    "key: %s", osmtpd_linedup());
+			if (conf_cb != NULL)
+				conf_cb(line, end);
+			if (strcmp(line, "smtp-session-timeout") == 0) {
+				session_timeout = strtonum(end, 0, INT_MAX,
+				    &errstr);
+				if (errstr != NULL)
+					osmtpd_errx(1, "Invalid line received: "
+					    "invalid smtp-sesion-timeout: %s",
+					    osmtpd_linedup());
+			}
+			continue;
+		}
+		else
+			osmtpd_errx(1, "Invalid line received: unknown message "
+			    "type: %s", osmtpd_linedup());
+		line = end;
+		if (versionlen != 0 &&
+		    strncmp(line, version, versionlen) == 0 &&
+		    line[versionlen] == '|')
+			end = line + versionlen;
+		else {
+			if (osmtpd_dectou64(&end, 4, INT_MAX, &num) == -1 ||
+			    end[0] != '.')
+				osmtpd_errx(1, "Invalid protocol received: %s",
+				    osmtpd_linedup());
+			major = num;
+			end++;
+			if (osmtpd_dectou64(&end, 4, INT_MAX, &num) == -1)
+				osmtpd_errx(1, "Invalid protocol received: %s",
+				    osmtpd_linedup());
+			if (end[0] == '\0')
+				osmtpd_errx(1, "Invalid line received: missing "
+				    "time: %s", osmtpd_linedup());
+			if (end[0] != '|')
+				osmtpd_errx(1, "Invalid protocol received: %s",
+				    osmtpd_linedup());
+			if (versionlen != 0)
+				osmtpd_errx(1, "Protocol version changed: %s",
+				    osmtpd_linedup());
+			osmtpd_setversion(line, end - line, major, num);
+		}
+		end++;
+		if (osmtpd_dectou64(&end, 19, INT64_MAX, &num) == -1 ||
+		    end[0] != '.')
+			osmtpd_errx(1, "Invalid line received: invalid "
+			    "timestamp: %s", osmtpd_linedup());
+		tm.tv_sec = (time_t)num;
+		line = ++end;
+		if (osmtpd_dectou64(&end, 9, 999999999, &num) == -1)
+			osmtpd_errx(1, "Invalid line received: invalid "
+			    "timestamp: %s", osmtpd_linedup());
+		if (end[0] == '\0')
 			osmtpd_errx(1, "Invalid line received: missing "
-			    "phase: %s", linedup);
-		end++[0] = '\0';
+			    "direction: %s", osmtpd_linedup());
+		if (end[0] != '|')
+			osmtpd_errx(1, "Invalid line received: invalid "
+			    "timestamp: %s", osmtpd_linedup());
+		tm.tv_nsec = (long)num * osmtpd_pow10[9 - (end - line)];
+		line = end + 1;
+		if ((end = osmtpd_field(line, '|')) == NULL)
+			osmtpd_errx(1, "Invalid line received: missing "
+			    "phase: %s", osmtpd_linedup());
 		if (strcmp(line, "smtp-in") == 0)
 			incoming = 1;
 		else if (strcmp(line, "smtp-out") == 0)
 			incoming = 0;
 		else
 			osmtpd_errx(1, "Invalid line: invalid direction: %s",
-			    linedup);
+			    osmtpd_linedup());
 		line = end;
-		if ((end = strchr(line, '|')) == NULL)
+		if ((end = osmtpd_field(line, '|')) == NULL)
 			osmtpd_errx(1, "Invalid line received: missing reqid: "
-			    "%s", linedup);
-		end++[0] = '\0';
-		phase = osmtpd_strtophase(line, linedup);
-		line = end;
-		errno = 0;
-		search.ctx.reqid = strtoull(line, &end, 16);
-		if ((search.ctx.reqid == ULLONG_MAX && errno != 0) ||
+			    "%s", osmtpd_linedup());
+		phase = osmtpd_strtophase(line, end - line - 1);
+		if (osmtpd_hextou64(&end, 16, &reqid) == -1 ||
 		    (end[0] != '|' && end[0] != '\0'))
 			osmtpd_errx(1, "Invalid line received: invalid reqid: "
-			    "%s", linedup);
-		line = end + 1;
-		ctx = RB_FIND(osmtpd_sessions, &osmtpd_sessions, &search);
-		if (ctx == NULL) {
-			if ((ctx = malloc(sizeof(*ctx))) == NULL)
-				osmtpd_err(1, NULL);
-			ctx->ctx.reqid = search.ctx.reqid;
+			    "%s", osmtpd_linedup());
+		line = end[0] == '\0' ? end : end + 1;
+		if ((ctx = osmtpd_session_find(reqid)) == NULL) {
+			if (memlimit != 0 &&
+			    !osmtpd_session_reserve(type, phase, reqid, line))
+				continue;
+			ctx = osmtpd_session_alloc();
+			ctx->ctx.reqid = reqid;
 			ctx->ctx.rdns = NULL;
 			ctx->ctx.fcrdns = OSMTPD_STATUS_TEMPFAIL;
 			ctx->ctx.identity = NULL;
@@ -1169,21 +1733,40 @@ osmtpd_newline(struct io *io, int ev, __unused void *arg)
 			ctx->ctx.ciphers = NULL;
 			ctx->ctx.msgid = 0;
 			ctx->ctx.mailfrom = NULL;
-			ctx->ctx.rcptto = malloc(sizeof(*(ctx->ctx.rcptto)));
-			if (ctx->ctx.rcptto == NULL)
-				osmtpd_err(1, "malloc");
-			ctx->ctx.rcptto[0] = NULL;
+			ctx->nrcpt = 0;
+			ctx->rcptsz = NITEMS(ctx->rcpt);
+			ctx->rcpt[0] = NULL;
+			ctx->ctx.rcptto = ctx->rcpt;
+			ctx->rcptstatus = ctx->rcptinstatus;
+			ctx->idsvalid = 0;
+			ctx->defer = NULL;
+			ctx->noffload = 0;
+			ctx->owed = 0;
+			ctx->overlimit = 0;
 			memset(&(ctx->ctx.src), 0, sizeof(ctx->ctx.src));
 			ctx->ctx.src.ss_family = AF_UNSPEC;
 			memset(&(ctx->ctx.dst), 0, sizeof(ctx->ctx.dst));
 			ctx->ctx.dst.ss_family = AF_UNSPEC;
-			RB_INSERT(osmtpd_sessions, &osmtpd_sessions, ctx);
+			osmtpd_session_insert(ctx);
 			ctx->ctx.evpid = 0;
 			ctx->ctx.local_session = NULL;
 			ctx->ctx.local_message = NULL;
 			if (oncreatecb_session != NULL)
 				ctx->ctx.local_session =
 				    oncreatecb_session(&ctx->ctx);
+			ctx->lastseen = now;
+			ctx->indata = 0;
+			TAILQ_INSERT_TAIL(&idlesessions[incoming], ctx, idle);
+			if (incoming && session_timeout != 0 &&
+			    !evtimer_pending(&reaper, NULL)) {
+				tv.tv_sec = (time_t)session_timeout * 2;
+				tv.tv_usec = 0;
+				evtimer_add(&reaper, &tv);
+			}
+		} else if (ctx->lastseen != now) {
+			TAILQ_REMOVE(&idlesessions[incoming], ctx, idle);
+			TAILQ_INSERT_TAIL(&idlesessions[incoming], ctx, idle);
+			ctx->lastseen = now;
 		}
 		ctx->ctx.type = type;
 		ctx->ctx.phase = phase;
@@ -1194,543 +1777,1681 @@ osmtpd_newline(struct io *io, int ev, __unused void *arg)
 		ctx->ctx.tm.tv_nsec = tm.tv_nsec;
 		ctx->ctx.token = 0;
 
-		for (i = 0; i < NITEMS(osmtpd_callbacks); i++) {
-			if (ctx->ctx.type == osmtpd_callbacks[i].type &&
-			    ctx->ctx.phase == osmtpd_callbacks[i].phase &&
-			    ctx->ctx.incoming == osmtpd_callbacks[i].incoming)
-				break;
-		}
-		if (i == NITEMS(osmtpd_callbacks)) {
+		callback = &(osmtpd_callbacks[type][phase][incoming]);
+		if (callback->osmtpd_cb == NULL) {
 			osmtpd_errx(1, "Invalid line received: received "
-			    "unregistered line: %s", linedup);
+			    "unregistered line: %s", osmtpd_linedup());
+		}
+		if (ctx->ctx.type == OSMTPD_TYPE_FILTER) {
+			end = line;
+			if (osmtpd_hextou64(&end, 16,
+			    &(ctx->ctx.token)) == -1 || end[0] != '|')
+				osmtpd_errx(1, "Invalid line received: invalid "
+				    "token: %s", osmtpd_linedup());
+			line = end + 1;
+			if (ctx->defer != NULL)
+				osmtpd_defer_cancel(ctx);
+			if (phase != OSMTPD_PHASE_DATA_LINE) {
+				ctx->owed = 1;
+				ctx->owedtoken = ctx->ctx.token;
+			}
+		}
+		if (callback->batch)
+			batchev = osmtpd_batch_add(&(ctx->ctx));
+		else if (nbatch != 0 &&
+		    (type == OSMTPD_TYPE_FILTER || callback->cb != NULL))
+			osmtpd_batch_flush();
+		if (part != NULL) {
+			if (type != OSMTPD_TYPE_FILTER ||
+			    phase != OSMTPD_PHASE_DATA_LINE || !callback->part)
+				osmtpd_errx(1, "Invalid line received: line "
+				    "too long: %s", osmtpd_linedup());
+			inpart = ctx;
+			osmtpd_dataline_part(part, partlen, 1);
+			part = NULL;
+			continue;
+		}
+		if (phase == OSMTPD_PHASE_PROTOCOL_CLIENT && incoming)
+			ctx->indata = strncasecmp(line, "DATA", 4) == 0;
+		if (ctx->overlimit && type == OSMTPD_TYPE_FILTER &&
+		    phase != OSMTPD_PHASE_DATA_LINE) {
+			metrics.sessions_refused++;
+			osmtpd_filter_disconnect(&(ctx->ctx),
+			    "Service temporarily unavailable");
+		} else
+			callback->osmtpd_cb(callback, &(ctx->ctx), line);
+		batchev = NULL;
+	}
+	osmtpd_batch_flush();
+	io_uncork(io_stdout);
+
+	if (outhiwat != 0 && !inpaused && io_queued(io_stdout) > outhiwat) {
+		io_pause(io, IO_IN);
+		inpaused = 1;
+		metrics.input_pauses++;
+	}
+}
+
+static struct osmtpd_event *
+osmtpd_batch_add(struct osmtpd_ctx *ctx)
+{
+	struct osmtpd_event *ev;
+	size_t newsz;
+
+	if (nbatch == batchsz) {
+		newsz = batchsz == 0 ? 64 : batchsz * 2;
+		if ((ev = reallocarray(batch, newsz, sizeof(*batch))) == NULL)
+			osmtpd_err(1, NULL);
+		batch = ev;
+		batchsz = newsz;
+	}
+	ev = &(batch[nbatch++]);
+	memset(ev, 0, sizeof(*ev));
+	ev->ctx = ctx;
+	ev->phase = ctx->phase;
+	ev->incoming = ctx->incoming;
+	ev->tm = ctx->tm;
+	return ev;
+}
+
+/*
+ * Deliver the pending batch. The strings in the events point into the
+ * input buffer, so this must happen before control returns to the event
+ * loop.
+ */
+static void
+osmtpd_batch_flush(void)
+{
+	struct osmtpd_session *session;
+	size_t n;
+
+	if ((n = nbatch) != 0) {
+		nbatch = 0;
+		batch_cb(batch, n);
+	}
+	while ((session = SLIST_FIRST(&batchgc)) != NULL) {
+		SLIST_REMOVE_HEAD(&batchgc, gc);
+		memgc -= session->mem;
+		osmtpd_session_free(session);
+	}
+}
+
+static void
+osmtpd_setversion(const char *str, size_t len, int major, int minor)
+{
+	if (major != 0 || len >= sizeof(version))
+		osmtpd_errx(1, "Unsupported protocol received: %s",
+		    osmtpd_linedup());
+#ifdef NO_LEGACY_PROTOCOL
+	if (minor < 6)
+		osmtpd_errx(1, "Unsupported protocol received: %s",
+		    osmtpd_linedup());
+	osmtpd_outids = osmtpd_outids_reqid;
+	osmtpd_txaddr = osmtpd_txaddr_status;
+#else
+	if (minor < 5)
+		osmtpd_outids = osmtpd_outids_token;
+	else
+		osmtpd_outids = osmtpd_outids_reqid;
+	if (minor < 6)
+		osmtpd_txaddr = osmtpd_txaddr_legacy;
+	else
+		osmtpd_txaddr = osmtpd_txaddr_status;
+#endif
+	memcpy(version, str, len);
+	versionlen = len;
+	version_major = major;
+	version_minor = minor;
+}
+
+/*
+ * A data-line too long for the input buffer is passed to the callback in
+ * parts. The header of the first part is returned as a line of its own,
+ * so the regular parsing finds the session, with the data in part. The
+ * parts after that are passed on directly.
+ */
+static char *
+osmtpd_getpart(struct io *io, char **part, size_t *partlen)
+{
+	static char hdr[128];
+	char *buf, *p, *phase = NULL;
+	size_t len, i;
+
+	if ((buf = io_getpart(io, &len)) == NULL)
+		return NULL;
+	if (inpart != NULL) {
+		osmtpd_dataline_part(buf, len, 1);
+		return NULL;
+	}
+	/* filter|version|timestamp|subsystem|data-line|reqid|token| */
+	p = buf;
+	for (i = 0; i < 7; i++) {
+		if ((p = memchr(p, '|', len - (p - buf))) == NULL)
+			break;
+		if (++p - buf >= (ptrdiff_t)sizeof(hdr))
+			break;
+		if (i == 3)
+			phase = p;
+	}
+	if (i < 7 || strncmp(buf, "filter|", 7) != 0 ||
+	    strncmp(phase, "data-line|", 10) != 0)
+		osmtpd_errx(1, "Invalid line received: line too long");
+	memcpy(hdr, buf, p - buf);
+	hdr[p - buf] = '\0';
+	*part = p;
+	*partlen = len - (p - buf);
+	return hdr;
+}
+
+/* Pass a part of the data-line of inpart on, the last one without more */
+static void
+osmtpd_dataline_part(const char *buf, size_t len, int more)
+{
+	struct osmtpd_session *session = inpart;
+	void (*f)(struct osmtpd_ctx *, const char *, size_t, int);
+
+	f = osmtpd_callbacks[OSMTPD_TYPE_FILTER][OSMTPD_PHASE_DATA_LINE][1].cb;
+	if (!more)
+		inpart = NULL;
+	if (session->lastseen != now) {
+		TAILQ_REMOVE(&idlesessions[1], session, idle);
+		TAILQ_INSERT_TAIL(&idlesessions[1], session, idle);
+		session->lastseen = now;
+	}
+	f(&(session->ctx), buf, len, more);
+}
+
+/* Point io_out at where the output of ctx goes */
+static void
+osmtpd_outio(struct osmtpd_ctx *ctx)
+{
+	if (outpart == NULL) {
+		io_out = io_stdout;
+		return;
+	}
+	if (&(outpart->ctx) == ctx)
+		osmtpd_errx(1, "Data-line written in parts not finished");
+	if (io_hold == NULL) {
+		if ((io_hold = io_new()) == NULL)
+			osmtpd_err(1, "io_new");
+		/* Only ever moved over to io_stdout */
+		io_cork(io_hold);
+	}
+	io_out = io_hold;
+}
+
+/*
+ * Queue "type|reqid|token|" followed by room for extra bytes, which is
+ * returned. The ids are only formatted again if the token changed.
+ */
+static char *
+osmtpd_outprefix(struct osmtpd_ctx *ctx, const char *type, size_t extra)
+{
+	const char *ids;
+	size_t typelen, idslen;
+	char *buf;
+
+	osmtpd_outio(ctx);
+	ids = osmtpd_ids(ctx);
+	idslen = sizeof(((struct osmtpd_session *)ctx)->ids);
+	typelen = strlen(type);
+	buf = io_reserve(io_out, typelen + 1 + idslen + extra);
+	if (buf == NULL)
+		osmtpd_err(1, "io_reserve");
+	memcpy(buf, type, typelen);
+	buf[typelen++] = '|';
+	memcpy(buf + typelen, ids, idslen);
+	return buf + typelen + idslen;
+}
+
+/* The cached "reqid|token|" of the session, not NUL-terminated */
+static const char *
+osmtpd_ids(struct osmtpd_ctx *ctx)
+{
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
+
+	if (!session->idsvalid || session->idstoken != ctx->token) {
+		osmtpd_outids(session->ids, ctx);
+		session->idstoken = ctx->token;
+		session->idsvalid = 1;
+	}
+	return session->ids;
+}
+
+/* Write v as 16 lowercase hex digits, as "%016"PRIx64 would */
+static void
+osmtpd_hexenc(char *dst, uint64_t v)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 15; i >= 0; i--) {
+		dst[i] = hex[v & 0xf];
+		v >>= 4;
+	}
+}
+
+static void
+osmtpd_outids_reqid(char *dst, struct osmtpd_ctx *ctx)
+{
+	osmtpd_hexenc(dst, ctx->reqid);
+	dst[16] = '|';
+	osmtpd_hexenc(dst + 17, ctx->token);
+	dst[33] = '|';
+}
+
+static void
+osmtpd_txaddr_status(char *status, char *addr, char **raddr,
+    enum osmtpd_status *rstatus)
+{
+	*rstatus = osmtpd_strtostatus(status);
+	*raddr = addr;
+}
+
+#ifndef NO_LEGACY_PROTOCOL
+/* Before 0.5 the token came before the reqid */
+static void
+osmtpd_outids_token(char *dst, struct osmtpd_ctx *ctx)
+{
+	osmtpd_hexenc(dst, ctx->token);
+	dst[16] = '|';
+	osmtpd_hexenc(dst + 17, ctx->reqid);
+	dst[33] = '|';
+}
+
+/* Before 0.6 the address came before the status */
+static void
+osmtpd_txaddr_legacy(char *addr, char *status, char **raddr,
+    enum osmtpd_status *rstatus)
+{
+	*raddr = addr;
+	*rstatus = osmtpd_strtostatus(status);
+}
+#endif
+
+/*
+ * Split off the field starting at field, returning the start of the next
+ * field, or NULL if sep can't be found.
+ */
+static char *
+osmtpd_field(char *field, int sep)
+{
+	char *end;
+
+	if ((end = strchr(field, sep)) == NULL)
+		return NULL;
+	osmtpd_cut(end);
+	return end + 1;
+}
+
+static void
+osmtpd_cut(char *sep)
+{
+	if (curline.ncut == NITEMS(curline.cut))
+		osmtpd_errx(1, "Invalid line received: too many fields: %s",
+		    osmtpd_linedup());
+	curline.cut[curline.ncut].off = sep - curline.buf;
+	curline.cut[curline.ncut++].c = sep[0];
+	sep[0] = '\0';
+}
+
+/*
+ * Rebuild the line currently being parsed. Only used for error reporting,
+ * so the copy is never freed.
+ */
+static const char *
+osmtpd_linedup(void)
+{
+	char *linedup;
+	size_t i;
+
+	if ((linedup = malloc(curline.len + 1)) == NULL)
+		osmtpd_err(1, NULL);
+	memcpy(linedup, curline.buf, curline.len + 1);
+	for (i = 0; i < curline.ncut; i++)
+		linedup[curline.cut[i].off] = curline.cut[i].c;
+	return linedup;
+}
+
+/*
+ * Decode the hex number at *s, which must have between 1 and maxdigits
+ * digits, and advance *s past it. Returns -1 on malformed input.
+ */
+static int
+osmtpd_hextou64(char **s, size_t maxdigits, uint64_t *val)
+{
+	const unsigned char *p = (const unsigned char *)*s;
+	uint64_t v = 0;
+	unsigned int d;
+	size_t n;
+
+	for (n = 0; (d = osmtpd_hexval[p[n]]) != 0; n++) {
+		if (n == maxdigits)
+			return -1;
+		v = (v << 4) | (d - 1);
+	}
+	if (n == 0)
+		return -1;
+	*s += n;
+	*val = v;
+	return 0;
+}
+
+/*
+ * Decode the decimal number at *s, which must have between 1 and maxdigits
+ * digits and not exceed max, and advance *s past it. maxdigits must not be
+ * over 19, so that the value can't overflow while decoding.
+ * Returns -1 on malformed input.
+ */
+static int
+osmtpd_dectou64(char **s, size_t maxdigits, uint64_t max, uint64_t *val)
+{
+	const unsigned char *p = (const unsigned char *)*s;
+	uint64_t v = 0;
+	unsigned int d;
+	size_t n;
+
+	for (n = 0; (d = p[n] - '0') <= 9; n++) {
+		if (n == maxdigits)
+			return -1;
+		v = v * 10 + d;
+	}
+	if (n == 0 || v > max)
+		return -1;
+	*s += n;
+	*val = v;
+	return 0;
+}
+
+/*
+ * Decode the 32 bit msgid all tx-* reports start with. The msgid must be
+ * followed by sep, after which *params points on return.
+ */
+static uint32_t
+osmtpd_strtomsgid(char **params, int sep)
+{
+	uint64_t msgid;
+	char *end = *params;
+
+	if (osmtpd_hextou64(&end, 8, &msgid) == -1)
+		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
+		    osmtpd_linedup());
+	if (end[0] != sep)
+		osmtpd_errx(1, "Invalid line received: missing address: %s",
+		    osmtpd_linedup());
+	*params = sep == '\0' ? end : end + 1;
+	return msgid;
+}
+
+static void
+osmtpd_outevt(__unused struct io *io, int evt, __unused void *arg)
+{
+	switch (evt) {
+	case IO_LOWAT:
+		if (ineof) {
+			if (io_queued(io_stdout) == 0)
+				event_base_loopexit(evbase, NULL);
+			return;
+		}
+		if (inpaused) {
+			io_resume(io_stdin, IO_IN);
+			inpaused = 0;
+		}
+		return;
+	case IO_DISCONNECTED:
+		exit(0);
+	default:
+		osmtpd_errx(1, "Unexpectd event");
+	}
+}
+
+static void
+osmtpd_noargs(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    __unused char *params)
+{
+	void (*f)(struct osmtpd_ctx *);
+
+	if ((f = cb->cb) != NULL)
+		f(ctx);
+}
+
+static void
+osmtpd_onearg(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx, char *line)
+{
+	void (*f)(struct osmtpd_ctx *, const char *);
+
+	if (batchev != NULL)
+		batchev->str = line;
+	if ((f = cb->cb) != NULL)
+		f(ctx, line);
+}
+
+static void
+osmtpd_dataline(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *line)
+{
+	void (*f)(struct osmtpd_ctx *, const char *, size_t, int);
+
+	if (!cb->part) {
+		osmtpd_onearg(cb, ctx, line);
+		return;
+	}
+	/* A complete line is a single last part */
+	f = cb->cb;
+	f(ctx, line, strlen(line), 0);
+}
+
+static void
+osmtpd_connect(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx, char *params)
+{
+	struct sockaddr_storage ss;
+	char *hostname;
+	char *address;
+	void (*f)(struct osmtpd_ctx *, const char *, struct sockaddr_storage *);
+
+	hostname = params;
+	if ((address = osmtpd_field(params, '|')) == NULL)
+		osmtpd_errx(1, "Invalid line received: missing address: %s",
+		    osmtpd_linedup());
+
+	osmtpd_addrtoss(address, &ss, 0);
+
+	f = cb->cb;
+	f(ctx, hostname, &ss);
+}
+
+static void
+osmtpd_identify(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *identity)
+{
+	void (*f)(struct osmtpd_ctx *, const char *);
+
+	if (cb->storereport)
+		osmtpd_istr_set(&(ctx->identity), identity);
+
+	f = cb->cb;
+	f(ctx, identity);
+}
+
+static void
+osmtpd_link_auth(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
+{
+	enum osmtpd_auth_result auth_res;
+	char * username, *end;
+	void (*f)(struct osmtpd_ctx *, const char *, enum osmtpd_auth_result);
+
+	if ((end = osmtpd_field(params, '|')) == NULL)
+		osmtpd_errx(1, "Invalid line received: missing username: %s",
+		    osmtpd_linedup());
+	username = params;
+	params = end;
+	if (strcmp(params, "pass") == 0)
+		auth_res = OSMTPD_AUTH_PASS;
+	else if (strcmp(params, "fail") == 0)
+		auth_res = OSMTPD_AUTH_FAIL;
+	else if (strcmp(params, "error") == 0)
+		auth_res = OSMTPD_AUTH_ERROR;
+	else
+		osmtpd_errx(1, "Invalid line received: invalid result: %s",
+		    osmtpd_linedup());
+
+	if (batchev != NULL) {
+		batchev->str = username;
+		batchev->auth = auth_res;
+	}
+	if ((f = cb->cb) != NULL)
+		f(ctx, username, auth_res);
+}
+
+static void
+osmtpd_link_connect(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
+{
+	char *end, *rdns;
+	enum osmtpd_status fcrdns;
+	struct sockaddr_storage src, dst;
+	void (*f)(struct osmtpd_ctx *, const char *, enum osmtpd_status,
+	    struct sockaddr_storage *, struct sockaddr_storage *);
+
+	if ((end = osmtpd_field(params, '|')) == NULL)
+		osmtpd_errx(1, "Invalid line received: missing fcrdns: %s",
+		    osmtpd_linedup());
+	rdns = params;
+	params = end;
+	if ((end = osmtpd_field(params, '|')) == NULL)
+		osmtpd_errx(1, "Invalid line received: missing src: %s",
+		    osmtpd_linedup());
+	if (strcmp(params, "pass") == 0)
+		fcrdns = OSMTPD_STATUS_OK;
+	else if (strcmp(params, "fail") == 0)
+		fcrdns = OSMTPD_STATUS_PERMFAIL;
+	else if (strcmp(params, "error") == 0)
+		fcrdns = OSMTPD_STATUS_TEMPFAIL;
+	else
+		osmtpd_errx(1, "Invalid line received: invalid fcrdns: %s",
+		    osmtpd_linedup());
+	params = end;
+	if ((end = osmtpd_field(params, '|')) == NULL)
+		osmtpd_errx(1, "Invalid line received: missing dst: %s",
+		    osmtpd_linedup());
+	osmtpd_addrtoss(params, &src, 1);
+	params = end;
+	osmtpd_addrtoss(params, &dst, 1);
+	if (cb->storereport) {
+		osmtpd_istr_set(&(ctx->rdns), rdns);
+		ctx->fcrdns = fcrdns;
+		memcpy(&(ctx->src), &src, sizeof(ctx->src));
+		memcpy(&(ctx->dst), &dst, sizeof(ctx->dst));
+	}
+	if (batchev != NULL) {
+		batchev->str = rdns;
+		batchev->status = fcrdns;
+	}
+	if ((f = cb->cb) != NULL)
+		f(ctx, rdns, fcrdns, &src, &dst);
+}
+
+static void
+osmtpd_link_disconnect(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    __unused char *param)
+{
+	void (*f)(struct osmtpd_ctx *);
+	struct osmtpd_session *session;
+
+	if ((f = cb->cb) != NULL)
+		f(ctx);
+
+	if ((session = osmtpd_session_remove(ctx->reqid)) != NULL)
+		osmtpd_session_drop(session);
+}
+
+static void
+osmtpd_session_drop(struct osmtpd_session *session)
+{
+	TAILQ_REMOVE(&idlesessions[session->ctx.incoming], session, idle);
+	/* Pending batched events may still refer to the session */
+	if (nbatch != 0) {
+		SLIST_INSERT_HEAD(&batchgc, session, gc);
+		memgc += session->mem;
+	} else
+		osmtpd_session_free(session);
+}
+
+static time_t
+osmtpd_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		osmtpd_err(1, "clock_gettime");
+	return ts.tv_sec;
+}
+
+static void
+osmtpd_reap(__unused int fd, __unused short ev, __unused void *arg)
+{
+	struct osmtpd_session *session;
+	struct timeval tv;
+	time_t idle;
+
+	if (session_timeout == 0)
+		return;
+	now = osmtpd_now();
+	idle = (time_t)session_timeout * 2;
+	while ((session = TAILQ_FIRST(&idlesessions[1])) != NULL &&
+	    now - session->lastseen >= idle) {
+		if (session->indata) {
+			TAILQ_REMOVE(&idlesessions[1], session, idle);
+			TAILQ_INSERT_TAIL(&idlesessions[1], session, idle);
+			session->lastseen = now;
+			continue;
+		}
+		osmtpd_session_remove(session->ctx.reqid);
+		osmtpd_session_drop(session);
+		metrics.sessions_evicted++;
+	}
+	if (session != NULL) {
+		tv.tv_sec = session->lastseen + idle - now;
+		tv.tv_usec = 0;
+		evtimer_add(&reaper, &tv);
+	}
+}
+
+/*
+ * Make room for a new session within memlimit. Returns 0 if the session
+ * is refused instead, in which case the line must be skipped.
+ */
+static int
+osmtpd_session_reserve(enum osmtpd_type type, enum osmtpd_phase phase,
+    uint64_t reqid, char *line)
+{
+	struct osmtpd_session refused;
+	char *end;
+
+	if (memused - memgc + sizeof(refused) <= memlimit)
+		return 1;
+	if (memlimit_policy == OSMTPD_MEMLIMIT_EVICT &&
+	    osmtpd_session_evict(NULL, sizeof(refused)))
+		return 1;
+	/* smtpd waits for the data-lines, they can't be dropped */
+	if (type == OSMTPD_TYPE_FILTER && phase == OSMTPD_PHASE_DATA_LINE)
+		return 1;
+	metrics.sessions_refused++;
+	/* Reports can't be answered, they're lost */
+	if (type != OSMTPD_TYPE_FILTER)
+		return 0;
+	/* Not inserted, only used to format the reply */
+	memset(&refused, 0, sizeof(refused));
+	refused.ctx.type = type;
+	refused.ctx.phase = phase;
+	refused.ctx.reqid = reqid;
+	end = line;
+	if (osmtpd_hextou64(&end, 16, &(refused.ctx.token)) == -1 ||
+	    end[0] != '|')
+		osmtpd_errx(1, "Invalid line received: invalid token: %s",
+		    osmtpd_linedup());
+	refused.owed = 1;
+	refused.owedtoken = refused.ctx.token;
+	osmtpd_filter_disconnect(&(refused.ctx),
+	    "Service temporarily unavailable");
+	return 0;
+}
+
+/*
+ * Free the least recently active sessions other than keep until need more
+ * bytes fit within memlimit. Returns 0 if they don't.
+ */
+static int
+osmtpd_session_evict(struct osmtpd_session *keep, size_t need)
+{
+	struct osmtpd_session *session, *in, *out;
+
+	in = TAILQ_FIRST(&idlesessions[1]);
+	out = TAILQ_FIRST(&idlesessions[0]);
+	while (memused - memgc + need > memlimit) {
+		if (in == NULL ||
+		    (out != NULL && out->lastseen < in->lastseen)) {
+			if ((session = out) == NULL)
+				return 0;
+			out = TAILQ_NEXT(out, idle);
+		} else {
+			session = in;
+			in = TAILQ_NEXT(in, idle);
+		}
+		if (session == keep || osmtpd_session_busy(session))
+			continue;
+		osmtpd_session_remove(session->ctx.reqid);
+		osmtpd_session_drop(session);
+		metrics.sessions_reclaimed++;
+	}
+	return 1;
+}
+
+/*
+ * A session smtpd is still waiting on can't be evicted, that would leave
+ * the smtpd session hanging until its own timeout.
+ */
+static int
+osmtpd_session_busy(struct osmtpd_session *session)
+{
+	return session->owed || session->defer != NULL ||
+	    session->noffload != 0 || session == inpart || session == outpart;
+}
+
+/*
+ * Account size more bytes to session. Beyond memlimit other sessions are
+ * evicted with OSMTPD_MEMLIMIT_EVICT, if the session still doesn't fit its
+ * filter events are refused like those of a new session.
+ */
+static void
+osmtpd_session_grow(struct osmtpd_session *session, size_t size)
+{
+	session->mem += size;
+	memused += size;
+	if (memlimit == 0 || memused - memgc <= memlimit)
+		return;
+	if (memlimit_policy == OSMTPD_MEMLIMIT_EVICT &&
+	    osmtpd_session_evict(session, 0))
+		return;
+	session->overlimit = 1;
+}
+
+static void
+osmtpd_session_shrink(struct osmtpd_session *session, size_t size)
+{
+	session->mem -= size;
+	memused -= size;
+	if (session->overlimit && memused - memgc <= memlimit)
+		session->overlimit = 0;
+}
+
+void
+osmtpd_memlimit(size_t limit, int policy)
+{
+	if (policy != OSMTPD_MEMLIMIT_TEMPFAIL &&
+	    policy != OSMTPD_MEMLIMIT_EVICT)
+		osmtpd_errx(1, "Invalid memory limit policy");
+	memlimit = limit;
+	memlimit_policy = policy;
+}
+
+void
+osmtpd_outq(size_t size, size_t maxfree)
+{
+	outqsize = size;
+	outqmaxfree = maxfree;
+	outqset = 1;
+	if (io_stdout != NULL)
+		io_set_qbuf(io_stdout, outqsize, outqmaxfree);
+}
+
+void
+osmtpd_inbuf(size_t size, size_t max)
+{
+	if (size == 0 || size > max)
+		osmtpd_errx(1, "Invalid input buffer size");
+	insize = size;
+	inmax = max;
+}
+
+void
+osmtpd_outwat(size_t hiwat, size_t lowat)
+{
+	if (hiwat != 0 && lowat >= hiwat)
+		osmtpd_errx(1, "Invalid output watermarks");
+	outhiwat = hiwat;
+	outlowat = lowat;
+	if (io_stdout != NULL) {
+		io_set_lowat(io_stdout, outlowat);
+		if (inpaused && (outhiwat == 0 ||
+		    io_queued(io_stdout) <= outlowat)) {
+			io_resume(io_stdin, IO_IN);
+			inpaused = 0;
 		}
-		if (ctx->ctx.type == OSMTPD_TYPE_FILTER) {
-			ctx->ctx.token = strtoull(line, &end, 16);
-			if ((ctx->ctx.token == ULLONG_MAX && errno != 0) ||
-			    end[0] != '|')
-				osmtpd_errx(1, "Invalid line received: invalid "
-				    "token: %s", linedup);
-			line = end + 1;
+	}
+}
+
+const struct osmtpd_metrics *
+osmtpd_metrics(void)
+{
+	size_t allocated, reused, reads, writes, rearms;
+
+	metrics.sessions = nsessions;
+	metrics.memory = memused;
+	metrics.input_paused = inpaused;
+	metrics.offload_pending = noffloadjobs;
+	if (io_stdout != NULL) {
+		io_qstats(io_stdout, &allocated, &reused);
+		metrics.outq_allocated = allocated;
+		metrics.outq_reused = reused;
+		metrics.output_queued = io_queued(io_stdout);
+		io_iostats(io_stdout, &reads, &writes, &rearms);
+		metrics.output_writes = writes;
+		metrics.output_rearms = rearms;
+	}
+	if (io_stdin != NULL) {
+		io_iostats(io_stdin, &reads, &writes, &rearms);
+		metrics.input_reads = reads;
+		metrics.input_rearms = rearms;
+	}
+	return &metrics;
+}
+
+static struct osmtpd_session *
+osmtpd_session_alloc(void)
+{
+	struct osmtpd_session *session, *slab;
+	size_t i;
+
+	if ((session = SLIST_FIRST(&sessionfree)) == NULL) {
+		/* Slabs are never returned, sessions are recycled instead */
+		slab = reallocarray(NULL, OSMTPD_SESSION_SLAB, sizeof(*slab));
+		if (slab == NULL)
+			osmtpd_err(1, NULL);
+		for (i = 0; i < OSMTPD_SESSION_SLAB; i++) {
+			osmtpd_arena_init(&(slab[i].msgarena),
+			    slab[i].msgarenabuf, sizeof(slab[i].msgarenabuf));
+			SLIST_INSERT_HEAD(&sessionfree, &(slab[i]), gc);
 		}
-		osmtpd_callbacks[i].osmtpd_cb(&(osmtpd_callbacks[i]),
-		    &(ctx->ctx), line, linedup);
+		session = SLIST_FIRST(&sessionfree);
 	}
-	io_resume(io_stdout, IO_OUT);
+	SLIST_REMOVE_HEAD(&sessionfree, gc);
+	session->mem = sizeof(*session);
+	memused += session->mem;
+	return session;
 }
 
 static void
-osmtpd_outevt(__unused struct io *io, int evt, __unused void *arg)
-{
-	switch (evt) {
-	case IO_LOWAT:
-		return;
-	case IO_DISCONNECTED:
-		exit(0);
-	default:
-		osmtpd_errx(1, "Unexpectd event");
+osmtpd_session_free(struct osmtpd_session *session)
+{
+	/* smtpd must not be left with half a line */
+	if (outpart == session)
+		osmtpd_filter_dataline_part(&(session->ctx), "", 0, 0);
+	if (ondeletecb_session != NULL)
+		ondeletecb_session(&(session->ctx), session->ctx.local_session);
+	osmtpd_istr_put(session->ctx.rdns);
+	osmtpd_istr_put(session->ctx.identity);
+	osmtpd_istr_put(session->ctx.greeting.identity);
+	osmtpd_istr_put(session->ctx.ciphers);
+	osmtpd_arena_reset(&(session->msgarena));
+	if (session->defer != NULL)
+		osmtpd_defer_cancel(session);
+	if (session->noffload != 0)
+		osmtpd_offload_orphan(session);
+	if (session->ctx.rcptto != session->rcpt) {
+		free(session->ctx.rcptto);
+		free(session->rcptstatus);
 	}
+	memused -= session->mem;
+	SLIST_INSERT_HEAD(&sessionfree, session, gc);
 }
 
 static void
-osmtpd_noargs(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    __unused char *params, __unused char *linedup)
+osmtpd_rcpt_grow(struct osmtpd_session *session)
+{
+	enum osmtpd_status *status;
+	char **rcpt;
+	size_t size;
+
+	if (SIZE_MAX / 2 < session->rcptsz)
+		osmtpd_errx(1, "Too many recipients");
+	size = session->rcptsz * 2;
+	if (session->ctx.rcptto == session->rcpt) {
+		osmtpd_session_grow(session,
+		    size * (sizeof(*rcpt) + sizeof(*status)));
+		rcpt = reallocarray(NULL, size, sizeof(*rcpt));
+		status = reallocarray(NULL, size, sizeof(*status));
+		if (rcpt == NULL || status == NULL)
+			osmtpd_err(1, NULL);
+		memcpy(rcpt, session->rcpt, sizeof(session->rcpt));
+		memcpy(status, session->rcptinstatus,
+		    sizeof(session->rcptinstatus));
+	} else {
+		osmtpd_session_grow(session,
+		    session->rcptsz * (sizeof(*rcpt) + sizeof(*status)));
+		rcpt = reallocarray(session->ctx.rcptto, size, sizeof(*rcpt));
+		if (rcpt == NULL)
+			osmtpd_err(1, NULL);
+		status = reallocarray(session->rcptstatus, size,
+		    sizeof(*status));
+		if (status == NULL)
+			osmtpd_err(1, NULL);
+	}
+	session->ctx.rcptto = rcpt;
+	session->rcptstatus = status;
+	session->rcptsz = size;
+}
+
+size_t
+osmtpd_rcpt_count(struct osmtpd_ctx *ctx)
 {
-	void (*f)(struct osmtpd_ctx *);
+	return ((struct osmtpd_session *)ctx)->nrcpt;
+}
 
-	f = cb->cb;
-	f(ctx);
+const char *
+osmtpd_rcpt_at(struct osmtpd_ctx *ctx, size_t i)
+{
+	if (i >= ((struct osmtpd_session *)ctx)->nrcpt)
+		osmtpd_errx(1, "Invalid recipient index");
+	return ctx->rcptto[i];
+}
+
+enum osmtpd_status
+osmtpd_rcpt_status(struct osmtpd_ctx *ctx, size_t i)
+{
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
+
+	if (i >= session->nrcpt)
+		osmtpd_errx(1, "Invalid recipient index");
+	return session->rcptstatus[i];
 }
 
 static void
-osmtpd_onearg(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx, char *line,
-    __unused char *linedup)
+osmtpd_link_greeting(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *identity)
 {
 	void (*f)(struct osmtpd_ctx *, const char *);
 
-	f = cb->cb;
-	f(ctx, line);
+	if (cb->storereport)
+		osmtpd_istr_set(&(ctx->greeting.identity), identity);
+
+	if (batchev != NULL)
+		batchev->str = identity;
+	if ((f = cb->cb) != NULL)
+		f(ctx, identity);
 }
 
 static void
-osmtpd_connect(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx, char *params,
-    char *linedup)
+osmtpd_link_identify(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *identity)
 {
-	struct sockaddr_storage ss;
-	char *hostname;
-	char *address;
-	void (*f)(struct osmtpd_ctx *, const char *, struct sockaddr_storage *);
-
-	hostname = params;
-	if ((address = strchr(params, '|')) == NULL)
-		osmtpd_errx(1, "Invalid line received: missing address: %s",
-		    linedup);
-	address++[0] = '\0';
+	void (*f)(struct osmtpd_ctx *, const char *);
 
-	osmtpd_addrtoss(address, &ss, 0, linedup);
+	if (cb->storereport)
+		osmtpd_istr_set(&(ctx->identity), identity);
 
-	f = cb->cb;
-	f(ctx, hostname, &ss);
+	if (batchev != NULL)
+		batchev->str = identity;
+	if ((f = cb->cb) != NULL)
+		f(ctx, identity);
 }
 
 static void
-osmtpd_identify(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *identity, __unused char *linedup)
+osmtpd_link_tls(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *ciphers)
 {
 	void (*f)(struct osmtpd_ctx *, const char *);
 
-	if (cb->storereport) {
-		free(ctx->identity);
-		if ((ctx->identity = strdup(identity)) == NULL)
-			osmtpd_err(1, "strdup");
-	}
+	if (cb->storereport)
+		osmtpd_istr_set(&(ctx->ciphers), ciphers);
 
-	f = cb->cb;
-	f(ctx, identity);
+	if (batchev != NULL)
+		batchev->str = ciphers;
+	if ((f = cb->cb) != NULL)
+		f(ctx, ciphers);
 }
 
 static void
-osmtpd_link_auth(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
+osmtpd_tx_begin(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *msgid)
 {
-	enum osmtpd_auth_result auth_res;
-	char * username, *end;
-	void (*f)(struct osmtpd_ctx *, const char *, enum osmtpd_auth_result);
+	uint64_t imsgid;
+	char *end = msgid;
+	void (*f)(struct osmtpd_ctx *, uint32_t);
 
-	if ((end = strchr(params, '|')) == NULL)
-		osmtpd_errx(1, "Invalid line received: missing username: %s",
-		    linedup);
-	end++[0] = '\0';
-	username = params;
-	params = end;
-	if (strcmp(params, "pass") == 0)
-		auth_res = OSMTPD_AUTH_PASS;
-	else if (strcmp(params, "fail") == 0)
-		auth_res = OSMTPD_AUTH_FAIL;
-	else if (strcmp(params, "error") == 0)
-		auth_res = OSMTPD_AUTH_ERROR;
-	else
-		osmtpd_errx(1, "Invalid line received: invalid result: %s",
-		    linedup);
+	if (osmtpd_hextou64(&end, 8, &imsgid) == -1 || end[0] != '\0')
+		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
+		    osmtpd_linedup());
+	ctx->msgid = imsgid;
+
+	if (!cb->storereport)
+		ctx->msgid = 0;
+
+	if (oncreatecb_message != NULL)
+		ctx->local_message = oncreatecb_message(ctx);
 
+	if (batchev != NULL)
+		batchev->msgid = imsgid;
 	if ((f = cb->cb) != NULL)
-		f(ctx, username, auth_res);
+		f(ctx, imsgid);
 }
 
 static void
-osmtpd_link_connect(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
+osmtpd_tx_mail(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
 {
-	char *end, *rdns;
-	enum osmtpd_status fcrdns;
-	struct sockaddr_storage src, dst;
-	void (*f)(struct osmtpd_ctx *, const char *, enum osmtpd_status,
-	    struct sockaddr_storage *, struct sockaddr_storage *);
+	struct osmtpd_session *session;
+	char *end, *mailfrom;
+	size_t mem;
+	enum osmtpd_status status;
+	uint32_t msgid;
+	void (*f)(struct osmtpd_ctx *, uint32_t, const char *,
+	    enum osmtpd_status);
 
-	if ((end = strchr(params, '|')) == NULL)
-		osmtpd_errx(1, "Invalid line received: missing fcrdns: %s",
-		    linedup);
-	end++[0] = '\0';
-	rdns = params;
-	params = end;
-	if ((end = strchr(params, '|')) == NULL)
-		osmtpd_errx(1, "Invalid line received: missing src: %s",
-		    linedup);
-	end++[0] = '\0';
-	if (strcmp(params, "pass") == 0)
-		fcrdns = OSMTPD_STATUS_OK;
-	else if (strcmp(params, "fail") == 0)
-		fcrdns = OSMTPD_STATUS_PERMFAIL;
-	else if (strcmp(params, "error") == 0)
-		fcrdns = OSMTPD_STATUS_TEMPFAIL;
-	else
-		osmtpd_errx(1, "Invalid line received: invalid fcrdns: %s",
-		    linedup);
-	params = end;
-	if ((end = strchr(params, '|')) == NULL)
-		osmtpd_errx(1, "Invalid line received: missing dst: %s",
-		    linedup);
-	end++[0] = '\0';
-	osmtpd_addrtoss(params, &src, 1, linedup);
-	params = end;
-	osmtpd_addrtoss(params, &dst, 1, linedup);
-	if (cb->storereport) {
-		if ((ctx->rdns = strdup(rdns)) == NULL)
-			osmtpd_err(1, "strdup");
-		ctx->fcrdns = fcrdns;
-		memcpy(&(ctx->src), &src, sizeof(ctx->src));
-		memcpy(&(ctx->dst), &dst, sizeof(ctx->dst));
+	msgid = osmtpd_strtomsgid(&params, '|');
+
+	if ((end = osmtpd_field(params, '|')) == NULL)
+		osmtpd_errx(1, "Invalid line received: missing status: %s",
+		    osmtpd_linedup());
+	osmtpd_txaddr(params, end, &mailfrom, &status);
+	session = (struct osmtpd_session *)ctx;
+	if (cb->storereport && !session->overlimit) {
+		mem = session->msgarena.mem;
+		ctx->mailfrom = osmtpd_arena_strset(&session->msgarena,
+		    ctx->mailfrom, mailfrom);
+		osmtpd_session_grow(session, session->msgarena.mem - mem);
+	}
+
+	if (batchev != NULL) {
+		batchev->msgid = msgid;
+		batchev->str = mailfrom;
+		batchev->status = status;
 	}
 	if ((f = cb->cb) != NULL)
-		f(ctx, rdns, fcrdns, &src, &dst);
+		f(ctx, msgid, mailfrom, status);
 }
 
 static void
-osmtpd_link_disconnect(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    __unused char *param, __unused char *linedup)
+osmtpd_tx_rcpt(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
 {
-	void (*f)(struct osmtpd_ctx *);
-	size_t i;
-	struct osmtpd_session *session, search;
+	struct osmtpd_session *session;
+	char *end, *rcptto;
+	size_t mem;
+	enum osmtpd_status status;
+	uint32_t msgid;
+	void (*f)(struct osmtpd_ctx *, uint32_t, const char *,
+	    enum osmtpd_status);
 
-	if ((f = cb->cb) != NULL)
-		f(ctx);
+	msgid = osmtpd_strtomsgid(&params, '|');
 
-	search.ctx.reqid = ctx->reqid;
-	session = RB_FIND(osmtpd_sessions, &osmtpd_sessions, &search);
-	if (session != NULL) {
-		RB_REMOVE(osmtpd_sessions, &osmtpd_sessions, session);
-		if (ondeletecb_session != NULL)
-			ondeletecb_session(ctx, session->ctx.local_session);
-		free(session->ctx.rdns);
-		free(session->ctx.identity);
-		free(session->ctx.greeting.identity);
-		free(session->ctx.ciphers);
-		free(session->ctx.mailfrom);
-		for (i = 0; session->ctx.rcptto[i] != NULL; i++)
-			free(session->ctx.rcptto[i]);
-		free(session->ctx.rcptto);
-		free(session);
+	if ((end = osmtpd_field(params, '|')) == NULL)
+		osmtpd_errx(1, "Invalid line received: missing status: %s",
+		    osmtpd_linedup());
+
+	osmtpd_txaddr(params, end, &rcptto, &status);
+
+	session = (struct osmtpd_session *)ctx;
+	if (cb->storereport && !session->overlimit) {
+		/* Keep room for the NULL terminator */
+		if (session->nrcpt + 1 == session->rcptsz)
+			osmtpd_rcpt_grow(session);
+		mem = session->msgarena.mem;
+		ctx->rcptto[session->nrcpt] = osmtpd_arena_strset(
+		    &session->msgarena, NULL, rcptto);
+		osmtpd_session_grow(session, session->msgarena.mem - mem);
+		session->rcptstatus[session->nrcpt++] = status;
+		ctx->rcptto[session->nrcpt] = NULL;
+	}
+
+	if (batchev != NULL) {
+		batchev->msgid = msgid;
+		batchev->str = rcptto;
+		batchev->status = status;
 	}
+	if ((f = cb->cb) != NULL)
+		f(ctx, msgid, rcptto, status);
 }
 
 static void
-osmtpd_link_greeting(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *identity, __unused char *linedup)
+osmtpd_tx_envelope(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
 {
-	void (*f)(struct osmtpd_ctx *, const char *);
+	uint32_t msgid;
+	uint64_t evpid;
+	char *end;
+	void (*f)(struct osmtpd_ctx *, uint32_t, uint64_t);
 
-	if (cb->storereport) {
-		free(ctx->greeting.identity);
-		if ((ctx->greeting.identity = strdup(identity)) == NULL)
-			osmtpd_err(1, NULL);
+	msgid = osmtpd_strtomsgid(&params, '|');
+
+	end = params;
+	if (osmtpd_hextou64(&end, 16, &evpid) == -1 || end[0] != '\0')
+		osmtpd_errx(1, "Invalid line received: invalid evpid: %s",
+		    osmtpd_linedup());
+	if (cb->storereport)
+		ctx->evpid = evpid;
+
+	if (batchev != NULL) {
+		batchev->msgid = msgid;
+		batchev->evpid = evpid;
 	}
+	if ((f = cb->cb) != NULL)
+		f(ctx, msgid, evpid);
+}
+
+static void
+osmtpd_tx_data(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
+{
+	uint32_t msgid;
+	enum osmtpd_status status;
+	void (*f)(struct osmtpd_ctx *, uint32_t, enum osmtpd_status);
+
+	msgid = osmtpd_strtomsgid(&params, '|');
 
+	status = osmtpd_strtostatus(params);
+	if (batchev != NULL) {
+		batchev->msgid = msgid;
+		batchev->status = status;
+	}
 	if ((f = cb->cb) != NULL)
-		f(ctx, identity);
+		f(ctx, msgid, status);
 }
 
 static void
-osmtpd_link_identify(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *identity, __unused char *linedup)
+osmtpd_tx_commit(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
 {
-	void (*f)(struct osmtpd_ctx *, const char *);
+	char *end;
+	uint64_t num;
+	uint32_t msgid;
+	void (*f)(struct osmtpd_ctx *, uint32_t, size_t);
 
-	if (cb->storereport) {
-		free(ctx->identity);
-		if ((ctx->identity = strdup(identity)) == NULL)
-			osmtpd_err(1, NULL);
+	msgid = osmtpd_strtomsgid(&params, '|');
+
+	end = params;
+	if (osmtpd_dectou64(&end, 10, UINT32_MAX, &num) == -1 ||
+	    end[0] != '\0')
+		osmtpd_errx(1, "Invalid line received: invalid msg size: %s",
+		    osmtpd_linedup());
+
+	if (batchev != NULL) {
+		batchev->msgid = msgid;
+		batchev->msgsz = num;
 	}
+	if ((f = cb->cb) != NULL)
+		f(ctx, msgid, (size_t)num);
+
+	osmtpd_message_free(ctx);
+}
+
+static void
+osmtpd_tx_rollback(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
+    char *params)
+{
+	uint32_t msgid;
+	void (*f)(struct osmtpd_ctx *, uint32_t);
+
+	msgid = osmtpd_strtomsgid(&params, '\0');
 
+	if (batchev != NULL)
+		batchev->msgid = msgid;
 	if ((f = cb->cb) != NULL)
-		f(ctx, identity);
+		f(ctx, msgid);
+
+	osmtpd_message_free(ctx);
 }
 
 static void
-osmtpd_link_tls(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *ciphers, __unused char *linedup)
+osmtpd_message_free(struct osmtpd_ctx *ctx)
 {
-	void (*f)(struct osmtpd_ctx *, const char *);
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
+	size_t mem;
 
-	if (cb->storereport) {
-		if ((ctx->ciphers = strdup(ciphers)) == NULL)
+	if (ondeletecb_message != NULL) {
+		ondeletecb_message(ctx, ctx->local_message);
+		ctx->local_message = NULL;
+	}
+
+	mem = session->msgarena.mem;
+	osmtpd_arena_reset(&(session->msgarena));
+	osmtpd_session_shrink(session, mem);
+	ctx->mailfrom = NULL;
+	/* Keep the recipient vector, the next transaction can reuse it */
+	session->nrcpt = 0;
+	ctx->rcptto[0] = NULL;
+	ctx->evpid = 0;
+	ctx->msgid = 0;
+}
+
+/* FNV-1a */
+static uint64_t
+osmtpd_strhash(const char *str, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (len-- > 0) {
+		hash ^= (unsigned char)*str++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static const char *
+osmtpd_istr_get(const char *str)
+{
+	struct osmtpd_istr *istr, *next, **table;
+	uint64_t hash;
+	size_t len, i, size;
+
+	len = strlen(str);
+	hash = osmtpd_strhash(str, len);
+	if (istrs != NULL) {
+		for (istr = istrs[hash & istrsmask]; istr != NULL;
+		    istr = istr->next) {
+			if (istr->hash == hash && istr->len == len &&
+			    memcmp(istr->str, str, len) == 0) {
+				istr->refcnt++;
+				return istr->str;
+			}
+		}
+	}
+
+	/* Keep the chains short, grow at a load factor of 1 */
+	if (nistrs == istrsmask + 1 || istrs == NULL) {
+		size = istrs == NULL ? 64 : (istrsmask + 1) * 2;
+		if ((table = calloc(size, sizeof(*table))) == NULL)
 			osmtpd_err(1, NULL);
+		for (i = 0; istrs != NULL && i <= istrsmask; i++) {
+			for (istr = istrs[i]; istr != NULL; istr = next) {
+				next = istr->next;
+				istr->next = table[istr->hash & (size - 1)];
+				table[istr->hash & (size - 1)] = istr;
+			}
+		}
+		if (istrs != NULL)
+			memused -= (istrsmask + 1) * sizeof(*istrs);
+		free(istrs);
+		istrs = table;
+		istrsmask = size - 1;
+		memused += size * sizeof(*istrs);
 	}
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, ciphers);
+	if ((istr = malloc(sizeof(*istr) + len + 1)) == NULL)
+		osmtpd_err(1, NULL);
+	istr->hash = hash;
+	istr->refcnt = 1;
+	istr->len = len;
+	memcpy(istr->str, str, len + 1);
+	istr->next = istrs[hash & istrsmask];
+	istrs[hash & istrsmask] = istr;
+	nistrs++;
+	memused += sizeof(*istr) + len + 1;
+	return istr->str;
 }
 
 static void
-osmtpd_tx_begin(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *msgid, char *linedup)
+osmtpd_istr_put(const char *str)
 {
-	unsigned long imsgid;
-	char *endptr;
-	void (*f)(struct osmtpd_ctx *, uint32_t);
+	struct osmtpd_istr *istr, **prev;
 
-	errno = 0;
-	imsgid = strtoul(msgid, &endptr, 16);
-	if ((imsgid == ULONG_MAX && errno != 0) || endptr[0] != '\0')
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	ctx->msgid = imsgid;
-	/* Check if we're in range */
-	if ((unsigned long) ctx->msgid != imsgid)
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
+	if (str == NULL)
+		return;
+	if (istrs == NULL)
+		osmtpd_errx(1, "Releasing string which isn't interned");
+	prev = &(istrs[osmtpd_strhash(str, strlen(str)) & istrsmask]);
+	for (; (istr = *prev) != NULL; prev = &(istr->next)) {
+		if (istr->str != str)
+			continue;
+		if (--istr->refcnt == 0) {
+			*prev = istr->next;
+			nistrs--;
+			memused -= sizeof(*istr) + istr->len + 1;
+			free(istr);
+		}
+		return;
+	}
+	osmtpd_errx(1, "Releasing string which isn't interned");
+}
 
-	if (!cb->storereport)
-		ctx->msgid = 0;
+/* Replace an interned string, taking the reference before dropping one */
+static void
+osmtpd_istr_set(const char **dst, const char *str)
+{
+	const char *old = *dst;
 
-	if (oncreatecb_message != NULL)
-		ctx->local_message = oncreatecb_message(ctx);
+	*dst = osmtpd_istr_get(str);
+	osmtpd_istr_put(old);
+}
+
+const char *
+osmtpd_intern(const char *str)
+{
+	return osmtpd_istr_get(str);
+}
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, imsgid);
+void
+osmtpd_intern_release(const char *str)
+{
+	osmtpd_istr_put(str);
 }
 
 static void
-osmtpd_tx_mail(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
+osmtpd_arena_init(struct osmtpd_arena *arena, char *buf, size_t size)
 {
-	char *end, *mailfrom;
-	enum osmtpd_status status;
-	unsigned long imsgid;
-	uint32_t msgid;
-	void (*f)(struct osmtpd_ctx *, uint32_t, const char *,
-	    enum osmtpd_status);
+	arena->base = buf;
+	arena->size = size;
+	arena->cur = buf;
+	arena->left = size;
+	arena->blk = NULL;
+	arena->mem = 0;
+}
 
-	errno = 0;
-	imsgid = strtoul(params, &end, 16);
-	if ((imsgid == ULONG_MAX && errno != 0))
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	if (end[0] != '|')
-		osmtpd_errx(1, "Invalid line received: missing address: %s",
-		    linedup);
-	msgid = imsgid;
-	if ((unsigned long) msgid != imsgid)
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	params = end + 1;
+static void *
+osmtpd_arena_alloc(struct osmtpd_arena *arena, size_t size)
+{
+	struct osmtpd_arenablk *blk;
+	size_t pad, blksz;
+	void *ptr;
 
-	if ((end = strchr(params, '|')) == NULL)
-		osmtpd_errx(1, "Invalid line received: missing status: %s",
-		    linedup);
-	end++[0] = '\0';
-	if (ctx->version_major == 0 && ctx->version_minor < 6) {
-		mailfrom = params;
-		status = osmtpd_strtostatus(end, linedup);
-	} else {
-		mailfrom = end;
-		status = osmtpd_strtostatus(params, linedup);
-	}
-	if (cb->storereport) {
-		if ((ctx->mailfrom = strdup(mailfrom)) == NULL)
+	pad = -(uintptr_t)arena->cur & (sizeof(void *) - 1);
+	if (arena->left < pad || arena->left - pad < size) {
+		blksz = size > OSMTPD_ARENA_BLKSZ ? size : OSMTPD_ARENA_BLKSZ;
+		if (blksz > SIZE_MAX - sizeof(*blk))
+			osmtpd_errx(1, "arena allocation too large");
+		if ((blk = malloc(sizeof(*blk) + blksz)) == NULL)
 			osmtpd_err(1, NULL);
+		blk->next = arena->blk;
+		arena->blk = blk;
+		arena->mem += sizeof(*blk) + blksz;
+		arena->cur = blk->data;
+		arena->left = blksz;
+		pad = 0;
 	}
+	ptr = arena->cur + pad;
+	arena->cur += pad + size;
+	arena->left -= pad + size;
+	return ptr;
+}
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, msgid, mailfrom, status);
+/*
+ * Replace the arena string old by new. Reports like link-identify can be
+ * repeated during a session, reuse the old space if the new string fits.
+ */
+static char *
+osmtpd_arena_strset(struct osmtpd_arena *arena, char *old, const char *new)
+{
+	size_t len;
+
+	len = strlen(new) + 1;
+	if (old == NULL || strlen(old) + 1 < len)
+		old = osmtpd_arena_alloc(arena, len);
+	memcpy(old, new, len);
+	return old;
 }
 
 static void
-osmtpd_tx_rcpt(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
+osmtpd_arena_reset(struct osmtpd_arena *arena)
 {
-	char *end, *rcptto;
-	enum osmtpd_status status;
-	unsigned long imsgid;
-	uint32_t msgid;
-	size_t i;
-	void (*f)(struct osmtpd_ctx *, uint32_t, const char *,
-	    enum osmtpd_status);
+	struct osmtpd_arenablk *blk;
 
-	errno = 0;
-	imsgid = strtoul(params, &end, 16);
-	if ((imsgid == ULONG_MAX && errno != 0))
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	if (end[0] != '|')
-		osmtpd_errx(1, "Invalid line received: missing address: %s",
-		    linedup);
-	msgid = imsgid;
-	if ((unsigned long) msgid != imsgid)
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	params = end + 1;
+	while ((blk = arena->blk) != NULL) {
+		arena->blk = blk->next;
+		free(blk);
+	}
+	arena->cur = arena->base;
+	arena->left = arena->size;
+	arena->mem = 0;
+}
 
-	if ((end = strchr(params, '|')) == NULL)
-		osmtpd_errx(1, "Invalid line received: missing status: %s",
-		    linedup);
-	end++[0] = '\0';
+uint64_t
+osmtpd_defer(struct osmtpd_ctx *ctx, int timeout, enum osmtpd_status fallback)
+{
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
+	struct timeval tv;
 
-	if (ctx->version_major == 0 && ctx->version_minor < 6) {
-		rcptto = params;
-		status = osmtpd_strtostatus(end, linedup);
-	} else {
-		rcptto = end;
-		status = osmtpd_strtostatus(params, linedup);
-	}
+	if (ctx->type != OSMTPD_TYPE_FILTER ||
+	    ctx->phase == OSMTPD_PHASE_DATA_LINE)
+		osmtpd_errx(1, "Only filter events can be deferred");
+	if (timeout < 0)
+		osmtpd_errx(1, "Invalid defer timeout");
+	if (fallback != OSMTPD_STATUS_OK &&
+	    fallback != OSMTPD_STATUS_TEMPFAIL &&
+	    fallback != OSMTPD_STATUS_PERMFAIL)
+		osmtpd_errx(1, "Invalid defer fallback");
 
-	if (cb->storereport) {
-		for (i = 0; ctx->rcptto[i] != NULL; i++)
-			;
-		ctx->rcptto = reallocarray(ctx->rcptto, i + 2,
-		    sizeof(*(ctx->rcptto)));
-		if (ctx->rcptto == NULL)
+	if (session->defer == NULL) {
+		if ((session->defer = malloc(sizeof(*session->defer))) == NULL)
 			osmtpd_err(1, NULL);
+		osmtpd_session_grow(session, sizeof(*session->defer));
+		evtimer_set(&(session->defer->ev), osmtpd_defer_expire,
+		    session);
+		event_base_set(osmtpd_event_base(), &(session->defer->ev));
+	} else
+		evtimer_del(&(session->defer->ev));
+	session->defer->fallback = fallback;
 
-		if ((ctx->rcptto[i] = strdup(rcptto)) == NULL)
-			osmtpd_err(1, NULL);
-		ctx->rcptto[i + 1] = NULL;
-	}
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	evtimer_add(&(session->defer->ev), &tv);
+	return ctx->token;
+}
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, msgid, rcptto, status);
+/*
+ * Point ctx at the request osmtpd_defer returned ticket for. Returns 0 if
+ * it was answered already, a reply to it is then dropped.
+ */
+int
+osmtpd_defer_resume(struct osmtpd_ctx *ctx, uint64_t ticket)
+{
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
+
+	ctx->token = ticket;
+	return session->owed && session->owedtoken == ticket;
 }
 
 static void
-osmtpd_tx_envelope(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
+osmtpd_defer_cancel(struct osmtpd_session *session)
 {
-	unsigned long imsgid;
-	uint32_t msgid;
-	uint64_t evpid;
-	char *end;
-	void (*f)(struct osmtpd_ctx *, uint32_t, uint64_t);
-
-	errno = 0;
-	imsgid = strtoul(params, &end, 16);
-	if ((imsgid == ULONG_MAX && errno != 0))
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	if (end[0] != '|')
-		osmtpd_errx(1, "Invalid line received: missing address: %s",
-		    linedup);
-	msgid = imsgid;
-	if ((unsigned long) msgid != imsgid)
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	params = end + 1;
+	evtimer_del(&(session->defer->ev));
+	free(session->defer);
+	osmtpd_session_shrink(session, sizeof(*session->defer));
+	session->defer = NULL;
+}
 
-	evpid = strtoull(params, &end, 16);
-	if ((ctx->evpid == ULLONG_MAX && errno != 0) ||
-	    end[0] != '\0')
-		osmtpd_errx(1, "Invalid line received: invalid evpid: %s",
-		    linedup);
-	if (cb->storereport)
-		ctx->evpid = evpid;
+static void
+osmtpd_defer_expire(__unused int fd, __unused short event, void *arg)
+{
+	struct osmtpd_session *session = arg;
+	struct osmtpd_ctx *ctx = &(session->ctx);
+
+	ctx->token = session->owedtoken;
+	metrics.defers_expired++;
+	switch (session->defer->fallback) {
+	case OSMTPD_STATUS_OK:
+		osmtpd_filter_proceed(ctx);
+		break;
+	case OSMTPD_STATUS_TEMPFAIL:
+		osmtpd_filter_reject_enh(ctx, 451, 4, 3, 0,
+		    "Temporary failure");
+		break;
+	case OSMTPD_STATUS_PERMFAIL:
+		osmtpd_filter_reject_enh(ctx, 550, 5, 7, 1,
+		    "Delivery not authorized");
+		break;
+	}
+}
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, msgid, evpid);
+void
+osmtpd_offload_threads(int nthreads)
+{
+	if (offloadthreads != NULL)
+		osmtpd_errx(1, "Offload threads already started");
+	if (nthreads < 1)
+		osmtpd_errx(1, "Invalid number of offload threads");
+	noffloadthreads = nthreads;
 }
 
-static void
-osmtpd_tx_data(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
+void
+osmtpd_offload(struct osmtpd_ctx *ctx, void (*work)(void *),
+    void (*done)(struct osmtpd_ctx *, void *), void *arg)
 {
-	char *end;
-	unsigned long imsgid;
-	uint32_t msgid;
-	void (*f)(struct osmtpd_ctx *, uint32_t, enum osmtpd_status);
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
+	struct osmtpd_job *job;
 
-	errno = 0;
-	imsgid = strtoul(params, &end, 16);
-	if ((imsgid == ULONG_MAX && errno != 0))
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	if (end[0] != '|')
-		osmtpd_errx(1, "Invalid line received: missing address: %s",
-		    linedup);
-	msgid = imsgid;
-	if ((unsigned long) msgid != imsgid)
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	params = end + 1;
+	if (offloadthreads == NULL)
+		osmtpd_offload_start();
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, msgid, osmtpd_strtostatus(params, linedup));
+	if ((job = malloc(sizeof(*job))) == NULL)
+		osmtpd_err(1, NULL);
+	job->session = session;
+	job->token = ctx->token;
+	job->work = work;
+	job->done = done;
+	job->arg = arg;
+	session->noffload++;
+	TAILQ_INSERT_TAIL(&offloadjobs, job, inflight);
+	noffloadjobs++;
+
+	pthread_mutex_lock(&offloadmtx);
+	TAILQ_INSERT_TAIL(&offloadq, job, entry);
+	pthread_cond_signal(&offloadcond);
+	pthread_mutex_unlock(&offloadmtx);
 }
 
 static void
-osmtpd_tx_commit(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
+osmtpd_offload_start(void)
 {
-	char *end;
-	const char *errstr = NULL;
-	unsigned long imsgid;
-	uint32_t msgid;
-	size_t i, msgsz;
-	void (*f)(struct osmtpd_ctx *, uint32_t, size_t);
+	struct event_base *base;
+	long ncpu;
+	int i, error;
 
-	errno = 0;
-	imsgid = strtoul(params, &end, 16);
-	if ((imsgid == ULONG_MAX && errno != 0))
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	if (end[0] != '|')
-		osmtpd_errx(1, "Invalid line received: missing address: %s",
-		    linedup);
-	msgid = imsgid;
-	if ((unsigned long) msgid != imsgid)
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	params = end + 1;
+	if (noffloadthreads == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		noffloadthreads = ncpu < 1 ? 1 : ncpu > 64 ? 64 : (int)ncpu;
+	}
 
-	msgsz = strtonum(params, 0, UINT32_MAX, &errstr);
-	if (errstr != NULL)
-		osmtpd_errx(1, "Invalid line received: invalid msg size: %s",
-		    linedup);
+#ifdef __linux__
+	if ((offloadfd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		osmtpd_err(1, "eventfd");
+	offloadfd[1] = offloadfd[0];
+#else
+	if (pipe(offloadfd) == -1)
+		osmtpd_err(1, "pipe");
+	io_set_nonblocking(offloadfd[0]);
+	io_set_nonblocking(offloadfd[1]);
+#endif
+	base = osmtpd_event_base();
+	event_set(&offloadev, offloadfd[0], EV_READ | EV_PERSIST,
+	    osmtpd_offload_done, NULL);
+	event_base_set(base, &offloadev);
+	event_add(&offloadev, NULL);
+
+	offloadthreads = reallocarray(NULL, noffloadthreads,
+	    sizeof(*offloadthreads));
+	if (offloadthreads == NULL)
+		osmtpd_err(1, NULL);
+	for (i = 0; i < noffloadthreads; i++) {
+		error = pthread_create(&(offloadthreads[i]), NULL,
+		    osmtpd_offload_worker, NULL);
+		if (error != 0) {
+			errno = error;
+			osmtpd_err(1, "pthread_create");
+		}
+	}
+}
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, msgid, msgsz);
+/*
+ * Let the workers finish what has been queued and deliver the results, so
+ * every done callback is called exactly once.
+ */
+static void
+osmtpd_offload_stop(void)
+{
+	int i;
 
-	if (ondeletecb_message != NULL) {
-		ondeletecb_message(ctx, ctx->local_message);
-		ctx->local_message = NULL;
+	if (offloadthreads == NULL)
+		return;
+
+	pthread_mutex_lock(&offloadmtx);
+	offloadstop = 1;
+	pthread_cond_broadcast(&offloadcond);
+	pthread_mutex_unlock(&offloadmtx);
+	for (i = 0; i < noffloadthreads; i++)
+		pthread_join(offloadthreads[i], NULL);
+	osmtpd_offload_done(offloadfd[0], EV_READ, NULL);
+
+	event_del(&offloadev);
+	close(offloadfd[0]);
+	if (offloadfd[1] != offloadfd[0])
+		close(offloadfd[1]);
+	offloadfd[0] = offloadfd[1] = -1;
+	free(offloadthreads);
+	offloadthreads = NULL;
+	offloadstop = 0;
+}
+
+static void *
+osmtpd_offload_worker(__unused void *arg)
+{
+	struct osmtpd_job *job, *head;
+
+	for (;;) {
+		pthread_mutex_lock(&offloadmtx);
+		while (TAILQ_EMPTY(&offloadq) && !offloadstop)
+			pthread_cond_wait(&offloadcond, &offloadmtx);
+		if ((job = TAILQ_FIRST(&offloadq)) == NULL) {
+			pthread_mutex_unlock(&offloadmtx);
+			return NULL;
+		}
+		TAILQ_REMOVE(&offloadq, job, entry);
+		pthread_mutex_unlock(&offloadmtx);
+
+		job->work(job->arg);
+
+		head = atomic_load_explicit(&offloaddone, memory_order_relaxed);
+		do {
+			job->next = head;
+		} while (!atomic_compare_exchange_weak_explicit(&offloaddone,
+		    &head, job, memory_order_release, memory_order_relaxed));
+		/* Only the first result needs to wake up the loop */
+		if (head == NULL)
+			osmtpd_offload_wakeup();
 	}
+}
 
-	free(ctx->mailfrom);
-	ctx->mailfrom = NULL;
+static void
+osmtpd_offload_wakeup(void)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
 
-	for (i = 0; ctx->rcptto[i] != NULL; i++)
-		free(ctx->rcptto[i]);
-	ctx->rcptto[0] = NULL;
-	ctx->evpid = 0;
-	ctx->msgid = 0;
+	/* A full pipe or counter already guarantees a wakeup */
+	while (write(offloadfd[1], &one, sizeof(one)) == -1 && errno == EINTR)
+		;
 }
 
 static void
-osmtpd_tx_rollback(struct osmtpd_callback *cb, struct osmtpd_ctx *ctx,
-    char *params, char *linedup)
-{
-	char *end;
-	unsigned long imsgid;
-	uint32_t msgid;
-	size_t i;
-	void (*f)(struct osmtpd_ctx *, uint32_t);
+osmtpd_offload_done(int fd, __unused short event, __unused void *arg)
+{
+	struct osmtpd_job *job, *next, *jobs = NULL;
+	struct osmtpd_session *session;
+	char buf[64];
+
+	/* Drain before taking the stack, a later push wakes us up again */
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	job = atomic_exchange_explicit(&offloaddone, NULL,
+	    memory_order_acquire);
+	/* The stack is LIFO, return results in completion order */
+	for (; job != NULL; job = next) {
+		next = job->next;
+		job->next = jobs;
+		jobs = job;
+	}
 
-	errno = 0;
-	imsgid = strtoul(params, &end, 16);
-	if ((imsgid == ULONG_MAX && errno != 0))
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
-	if (end[0] != '\0')
-		osmtpd_errx(1, "Invalid line received: missing address: %s",
-		    linedup);
-	msgid = imsgid;
-	if ((unsigned long) msgid != imsgid)
-		osmtpd_errx(1, "Invalid line received: invalid msgid: %s",
-		    linedup);
+	for (job = jobs; job != NULL; job = next) {
+		next = job->next;
+		TAILQ_REMOVE(&offloadjobs, job, inflight);
+		noffloadjobs--;
+		if ((session = job->session) != NULL) {
+			session->noffload--;
+			session->ctx.token = job->token;
+		}
+		if (job->done != NULL)
+			job->done(session == NULL ? NULL : &(session->ctx),
+			    job->arg);
+		free(job);
+	}
+}
 
-	if ((f = cb->cb) != NULL)
-		f(ctx, msgid);
+/* The session is freed while work is running, done gets a NULL ctx */
+static void
+osmtpd_offload_orphan(struct osmtpd_session *session)
+{
+	struct osmtpd_job *job;
 
-	if (ondeletecb_message != NULL) {
-		ondeletecb_message(ctx, ctx->local_message);
-		ctx->local_message = NULL;
+	TAILQ_FOREACH(job, &offloadjobs, inflight) {
+		if (job->session == session)
+			job->session = NULL;
 	}
+	session->noffload = 0;
+}
 
-	free(ctx->mailfrom);
-	ctx->mailfrom = NULL;
+/*
+ * Called before a filter-result is written, returns 0 if it must be
+ * dropped. A reply belongs to the request whose token is in ctx->token.
+ * Report events reset it to 0, such a reply is taken to be for the request
+ * still waiting. Replies to a request which was answered already, like one
+ * whose osmtpd_defer fallback was sent, are late.
+ */
+static int
+osmtpd_result(struct osmtpd_ctx *ctx)
+{
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
 
-	for (i = 0; ctx->rcptto[i] != NULL; i++)
-		free(ctx->rcptto[i]);
-	ctx->rcptto[0] = NULL;
-	ctx->evpid = 0;
-	ctx->msgid = 0;
+	if (!session->owed ||
+	    (ctx->token != 0 && ctx->token != session->owedtoken)) {
+		metrics.defers_late++;
+		return 0;
+	}
+	ctx->token = session->owedtoken;
+	if (session->defer != NULL)
+		osmtpd_defer_cancel(session);
+	session->owed = 0;
+	return 1;
 }
 
 void
 osmtpd_filter_proceed(struct osmtpd_ctx *ctx)
 {
-	if (ctx->version_major == 0 && ctx->version_minor < 5)
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "proceed\n", ctx->token, ctx->reqid);
-	else
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "proceed\n", ctx->reqid, ctx->token);
+	if (!osmtpd_result(ctx))
+		return;
+	memcpy(osmtpd_outprefix(ctx, "filter-result", 8), "proceed\n", 8);
 }
 
 void
@@ -1741,16 +3462,14 @@ osmtpd_filter_reject(struct osmtpd_ctx *ctx, int code, const char *reason, ...)
 	if (code < 200 || code > 599)
 		osmtpd_errx(1, "Invalid reject code");
 
-	if (ctx->version_major == 0 && ctx->version_minor < 5)
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "reject|%d ", ctx->token, ctx->reqid, code);
-	else
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "reject|%d ", ctx->reqid, ctx->token, code);
+	if (!osmtpd_result(ctx))
+		return;
+	osmtpd_outprefix(ctx, "filter-result", 0);
+	io_printf(io_out, "reject|%d ", code);
 	va_start(ap, reason);
-	io_vprintf(io_stdout, reason, ap);
+	io_vprintf(io_out, reason, ap);
 	va_end(ap);
-	io_printf(io_stdout, "\n");
+	io_write(io_out, "\n", 1);
 }
 
 void
@@ -1768,18 +3487,15 @@ osmtpd_filter_reject_enh(struct osmtpd_ctx *ctx, int code, int class,
 	if (detail < 0 || detail > 999)
 		osmtpd_errx(1, "Invalid enhanced status detail");
 
-	if (ctx->version_major == 0 && ctx->version_minor < 5)
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "reject|%d %d.%d.%d ", ctx->token, ctx->reqid, code, class,
-		    subject, detail);
-	else
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "reject|%d %d.%d.%d ", ctx->reqid, ctx->token, code, class,
-		    subject, detail);
+	if (!osmtpd_result(ctx))
+		return;
+	osmtpd_outprefix(ctx, "filter-result", 0);
+	io_printf(io_out, "reject|%d %d.%d.%d ", code, class, subject,
+	    detail);
 	va_start(ap, reason);
-	io_vprintf(io_stdout, reason, ap);
+	io_vprintf(io_out, reason, ap);
 	va_end(ap);
-	io_printf(io_stdout, "\n");
+	io_write(io_out, "\n", 1);
 }
 
 void
@@ -1787,16 +3503,14 @@ osmtpd_filter_disconnect(struct osmtpd_ctx *ctx, const char *reason, ...)
 {
 	va_list ap;
 
-	if (ctx->version_major == 0 && ctx->version_minor < 5)
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "disconnect|421 ", ctx->token, ctx->reqid);
-	else
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "disconnect|421 ", ctx->reqid, ctx->token);
+	if (!osmtpd_result(ctx))
+		return;
+	osmtpd_outprefix(ctx, "filter-result", 0);
+	io_printf(io_out, "disconnect|421 ");
 	va_start(ap, reason);
-	io_vprintf(io_stdout, reason, ap);
+	io_vprintf(io_out, reason, ap);
 	va_end(ap);
-	io_printf(io_stdout, "\n");
+	io_write(io_out, "\n", 1);
 }
 
 void
@@ -1811,18 +3525,15 @@ osmtpd_filter_disconnect_enh(struct osmtpd_ctx *ctx, int class, int subject,
 		osmtpd_errx(1, "Invalid enhanced status subject");
 	if (detail < 0 || detail > 999)
 		osmtpd_errx(1, "Invalid enhanced status detail");
-	if (ctx->version_major == 0 && ctx->version_minor < 5)
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "disconnect|421 %d.%d.%d ", ctx->token, ctx->reqid, class,
-		    subject, detail);
-	else
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "disconnect|421 %d.%d.%d ", ctx->reqid, ctx->token, class,
-		    subject, detail);
+	if (!osmtpd_result(ctx))
+		return;
+	osmtpd_outprefix(ctx, "filter-result", 0);
+	io_printf(io_out, "disconnect|421 %d.%d.%d ", class, subject,
+	    detail);
 	va_start(ap, reason);
-	io_vprintf(io_stdout, reason, ap);
+	io_vprintf(io_out, reason, ap);
 	va_end(ap);
-	io_printf(io_stdout, "\n");
+	io_write(io_out, "\n", 1);
 }
 
 void
@@ -1830,16 +3541,14 @@ osmtpd_filter_rewrite(struct osmtpd_ctx *ctx, const char *value, ...)
 {
 	va_list ap;
 
-	if (ctx->version_major == 0 && ctx->version_minor < 5)
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "rewrite|", ctx->token, ctx->reqid);
-	else
-		io_printf(io_stdout, "filter-result|%016"PRIx64"|%016"PRIx64"|"
-		    "rewrite|", ctx->reqid, ctx->token);
+	if (!osmtpd_result(ctx))
+		return;
+	osmtpd_outprefix(ctx, "filter-result", 0);
+	io_printf(io_out, "rewrite|");
 	va_start(ap, value);
-	io_vprintf(io_stdout, value, ap);
+	io_vprintf(io_out, value, ap);
 	va_end(ap);
-	io_printf(io_stdout, "\n");
+	io_write(io_out, "\n", 1);
 }
 
 void
@@ -1847,113 +3556,270 @@ osmtpd_filter_dataline(struct osmtpd_ctx *ctx, const char *line, ...)
 {
 	va_list ap;
 
-	if (ctx->version_major == 0 && ctx->version_minor < 5)
-		io_printf(io_stdout, "filter-dataline|%016"PRIx64"|%016"PRIx64"|",
-		    ctx->token, ctx->reqid);
-	else
-		io_printf(io_stdout, "filter-dataline|%016"PRIx64"|%016"PRIx64"|",
-		    ctx->reqid, ctx->token);
+	osmtpd_outprefix(ctx, "filter-dataline", 0);
 	va_start(ap, line);
-	io_vprintf(io_stdout, line, ap);
+	io_vprintf(io_out, line, ap);
 	va_end(ap);
-	io_printf(io_stdout, "\n");
+	io_write(io_out, "\n", 1);
+}
+
+void
+osmtpd_filter_dataline_raw(struct osmtpd_ctx *ctx, const char *line,
+    size_t len)
+{
+	char *buf;
+
+	if (len > SIZE_MAX - 1)
+		osmtpd_errx(1, "Invalid dataline length");
+	buf = osmtpd_outprefix(ctx, "filter-dataline", len + 1);
+	memcpy(buf, line, len);
+	buf[len] = '\n';
+}
+
+void
+osmtpd_filter_dataline_iov(struct osmtpd_ctx *ctx, const struct iovec *iov,
+    int iovcnt)
+{
+	size_t len = 0;
+	char *buf;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > SIZE_MAX - 1 - len)
+			osmtpd_errx(1, "Invalid dataline length");
+		len += iov[i].iov_len;
+	}
+	buf = osmtpd_outprefix(ctx, "filter-dataline", len + 1);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+	buf[0] = '\n';
+}
+
+void
+osmtpd_filter_dataline_part(struct osmtpd_ctx *ctx, const char *part,
+    size_t len, int more)
+{
+	struct osmtpd_session *session = (struct osmtpd_session *)ctx;
+	char *buf;
+
+	if (len > SIZE_MAX - 1)
+		osmtpd_errx(1, "Invalid dataline length");
+	if (outpart == NULL)
+		buf = osmtpd_outprefix(ctx, "filter-dataline",
+		    more ? len : len + 1);
+	else if (outpart != session)
+		osmtpd_errx(1, "Another data-line is written in parts");
+	else if (len == 0 && more)
+		return;
+	else if ((buf = io_reserve(io_stdout, more ? len : len + 1)) == NULL)
+		osmtpd_err(1, "io_reserve");
+	memcpy(buf, part, len);
+	if (more) {
+		outpart = session;
+		return;
+	}
+	buf[len] = '\n';
+	outpart = NULL;
+	/* The output held back in the meantime can go now */
+	if (io_hold != NULL && io_queued(io_hold) != 0 &&
+	    io_move(io_stdout, io_hold) == -1)
+		osmtpd_err(1, "io_move");
+}
+
+void
+osmtpd_filter_message(struct osmtpd_ctx *ctx, const char *body, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)(uintptr_t)body;
+	iov.iov_len = len;
+	osmtpd_filter_message_iov(ctx, &iov, 1);
+}
+
+void
+osmtpd_filter_message_iov(struct osmtpd_ctx *ctx, const struct iovec *iov,
+    int iovcnt)
+{
+	char prefix[sizeof("filter-dataline|") - 1 +
+	    sizeof(((struct osmtpd_session *)ctx)->ids)];
+	struct osmtpd_msgout out;
+	size_t prefixlen;
+
+	prefixlen = sizeof("filter-dataline|") - 1;
+	memcpy(prefix, "filter-dataline|", prefixlen);
+	osmtpd_outio(ctx);
+	memcpy(prefix + prefixlen, osmtpd_ids(ctx), sizeof(prefix) - prefixlen);
+
+	/* Size everything first, so the last chunk is reserved exactly */
+	out.todo = osmtpd_message_fmt(NULL, prefix, sizeof(prefix), iov,
+	    iovcnt);
+	out.left = 0;
+	out.chunk = io_qsize(io_out);
+	(void)osmtpd_message_fmt(&out, prefix, sizeof(prefix), iov, iovcnt);
+}
+
+/*
+ * Split the message in iov on newlines and format each line as a
+ * data-line, with dot-stuffing and the terminating "." line. CRLF line
+ * endings are accepted. If dst is NULL only the length is returned.
+ */
+static size_t
+osmtpd_message_fmt(struct osmtpd_msgout *dst, const char *prefix,
+    size_t prefixlen, const struct iovec *iov, int iovcnt)
+{
+	const char *p, *nl;
+	size_t total = 0, left, seg;
+	int i, bol = 1, cr = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		left = iov[i].iov_len;
+		while (left > 0) {
+			/* A CR at the end of the previous buffer */
+			if (cr) {
+				if (p[0] != '\n')
+					osmtpd_message_emit(dst, &total,
+					    "\r", 1);
+				cr = 0;
+			}
+			if (bol) {
+				osmtpd_message_emit(dst, &total, prefix,
+				    prefixlen);
+				if (p[0] == '.')
+					osmtpd_message_emit(dst, &total,
+					    ".", 1);
+				bol = 0;
+			}
+			if ((nl = memchr(p, '\n', left)) != NULL)
+				seg = nl - p;
+			else
+				seg = left;
+			if (seg > 0 && p[seg - 1] == '\r') {
+				osmtpd_message_emit(dst, &total, p, seg - 1);
+				cr = (nl == NULL);
+			} else
+				osmtpd_message_emit(dst, &total, p, seg);
+			if (nl == NULL)
+				break;
+			osmtpd_message_emit(dst, &total, "\n", 1);
+			bol = 1;
+			p = nl + 1;
+			left -= seg + 1;
+		}
+	}
+	if (cr)
+		osmtpd_message_emit(dst, &total, "\r", 1);
+	if (!bol)
+		osmtpd_message_emit(dst, &total, "\n", 1);
+	osmtpd_message_emit(dst, &total, prefix, prefixlen);
+	osmtpd_message_emit(dst, &total, ".\n", 2);
+	return total;
+}
+
+static void
+osmtpd_message_emit(struct osmtpd_msgout *dst, size_t *total, const char *src,
+    size_t len)
+{
+	size_t n;
+
+	if (SIZE_MAX - *total < len)
+		osmtpd_errx(1, "Message too large");
+	*total += len;
+	if (dst == NULL)
+		return;
+	while (len > 0) {
+		if (dst->left == 0) {
+			dst->left = dst->todo < dst->chunk ?
+			    dst->todo : dst->chunk;
+			dst->todo -= dst->left;
+			if ((dst->buf = io_reserve(io_out, dst->left)) == NULL)
+				osmtpd_err(1, "io_reserve");
+		}
+		n = len < dst->left ? len : dst->left;
+		memcpy(dst->buf, src, n);
+		dst->buf += n;
+		dst->left -= n;
+		src += n;
+		len -= n;
+	}
 }
 
 static void
 osmtpd_register(enum osmtpd_type type, enum osmtpd_phase phase, int incoming,
     int storereport, void *cb)
 {
-	size_t i;
+	struct osmtpd_callback *callback;
 
 	if (ready)
 		osmtpd_errx(1, "Can't register when proc is running");
 
-	for (i = 0; i < NITEMS(osmtpd_callbacks); i++) {
-		if (type ==  osmtpd_callbacks[i].type &&
-		    phase == osmtpd_callbacks[i].phase &&
-		    incoming == osmtpd_callbacks[i].incoming) {
-			if (osmtpd_callbacks[i].cb != NULL && cb != NULL)
+	if ((size_t)type < NITEMS(osmtpd_callbacks) &&
+	    (size_t)phase < OSMTPD_NPHASES &&
+	    (incoming == 0 || incoming == 1)) {
+		callback = &(osmtpd_callbacks[type][phase][incoming]);
+		if (callback->osmtpd_cb != NULL) {
+			if ((callback->cb != NULL || callback->batch) &&
+			    cb != NULL)
 				osmtpd_errx(1, "Event already registered");
 			if (cb != NULL)
-				osmtpd_callbacks[i].cb = cb;
-			osmtpd_callbacks[i].doregister = 1;
+				callback->cb = cb;
+			callback->doregister = 1;
 			if (storereport)
-				osmtpd_callbacks[i].storereport = 1;
+				callback->storereport = 1;
 			return;
 		}
 	}
-	/* NOT REACHED */
 	osmtpd_errx(1, "Trying to register unknown event");
 }
 
+/*
+ * The first, middle and last character together with the length are unique
+ * for every phase name, the multiplier spreads them over the table without
+ * collisions.
+ */
+static size_t
+osmtpd_phasehash_slot(const char *phase, size_t len)
+{
+	uint32_t key;
+
+	key = (uint32_t)(unsigned char)phase[0] |
+	    (uint32_t)(unsigned char)phase[len - 1] << 8 |
+	    (uint32_t)(unsigned char)phase[len / 2] << 16 |
+	    (uint32_t)len << 24;
+	return (uint32_t)(key * 0x9aabad73U) >> (32 - OSMTPD_PHASEHASH_BITS);
+}
+
+static void
+osmtpd_phasehash_init(void)
+{
+	size_t i, slot;
+
+	for (i = 0; i < OSMTPD_NPHASES; i++) {
+		slot = osmtpd_phasehash_slot(osmtpd_phases[i].name,
+		    osmtpd_phases[i].len);
+		if (osmtpd_phasehash[slot] != 0)
+			osmtpd_errx(1, "Phase hash collision: %s",
+			    osmtpd_phases[i].name);
+		osmtpd_phasehash[slot] = i + 1;
+	}
+}
+
 static enum osmtpd_phase
-osmtpd_strtophase(const char *phase, const char *linedup)
-{
-	if (strcmp(phase, "connect") == 0)
-		return OSMTPD_PHASE_CONNECT;
-	if (strcmp(phase, "helo") == 0)
-		return OSMTPD_PHASE_HELO;
-	if (strcmp(phase, "ehlo") == 0)
-		return OSMTPD_PHASE_EHLO;
-	if (strcmp(phase, "starttls") == 0)
-		return OSMTPD_PHASE_STARTTLS;
-	if (strcmp(phase, "auth") == 0)
-		return OSMTPD_PHASE_AUTH;
-	if (strcmp(phase, "mail-from") == 0)
-		return OSMTPD_PHASE_MAIL_FROM;
-	if (strcmp(phase, "rcpt-to") == 0)
-		return OSMTPD_PHASE_RCPT_TO;
-	if (strcmp(phase, "data") == 0)
-		return OSMTPD_PHASE_DATA;
-	if (strcmp(phase, "data-line") == 0)
-		return OSMTPD_PHASE_DATA_LINE;
-	if (strcmp(phase, "rset") == 0)
-		return OSMTPD_PHASE_RSET;
-	if (strcmp(phase, "quit") == 0)
-		return OSMTPD_PHASE_QUIT;
-	if (strcmp(phase, "noop") == 0)
-		return OSMTPD_PHASE_NOOP;
-	if (strcmp(phase, "help") == 0)
-		return OSMTPD_PHASE_HELP;
-	if (strcmp(phase, "wiz") == 0)
-		return OSMTPD_PHASE_WIZ;
-	if (strcmp(phase, "commit") == 0)
-		return OSMTPD_PHASE_COMMIT;
-	if (strcmp(phase, "link-auth") == 0)
-		return OSMTPD_PHASE_LINK_AUTH;
-	if (strcmp(phase, "link-connect") == 0)
-		return OSMTPD_PHASE_LINK_CONNECT;
-	if (strcmp(phase, "link-disconnect") == 0)
-		return OSMTPD_PHASE_LINK_DISCONNECT;
-	if (strcmp(phase, "link-greeting") == 0)
-		return OSMTPD_PHASE_LINK_GREETING;
-	if (strcmp(phase, "link-identify") == 0)
-		return OSMTPD_PHASE_LINK_IDENTIFY;
-	if (strcmp(phase, "link-tls") == 0)
-		return OSMTPD_PHASE_LINK_TLS;
-	if (strcmp(phase, "tx-begin") == 0)
-		return OSMTPD_PHASE_TX_BEGIN;
-	if (strcmp(phase, "tx-mail") == 0)
-		return OSMTPD_PHASE_TX_MAIL;
-	if (strcmp(phase, "tx-rcpt") == 0)
-		return OSMTPD_PHASE_TX_RCPT;
-	if (strcmp(phase, "tx-envelope") == 0)
-		return OSMTPD_PHASE_TX_ENVELOPE;
-	if (strcmp(phase, "tx-data") == 0)
-		return OSMTPD_PHASE_TX_DATA;
-	if (strcmp(phase, "tx-commit") == 0)
-		return OSMTPD_PHASE_TX_COMMIT;
-	if (strcmp(phase, "tx-rollback") == 0)
-		return OSMTPD_PHASE_TX_ROLLBACK;
-	if (strcmp(phase, "protocol-client") == 0)
-		return OSMTPD_PHASE_PROTOCOL_CLIENT;
-	if (strcmp(phase, "protocol-server") == 0)
-		return OSMTPD_PHASE_PROTOCOL_SERVER;
-	if (strcmp(phase, "filter-response") == 0)
-		return OSMTPD_PHASE_FILTER_RESPONSE;
-	if (strcmp(phase, "timeout") == 0)
-		return OSMTPD_PHASE_TIMEOUT;
-	osmtpd_errx(1, "Invalid line received: invalid phase: %s", linedup);
+osmtpd_strtophase(const char *phase, size_t len)
+{
+	size_t i;
+
+	if (len != 0 &&
+	    (i = osmtpd_phasehash[osmtpd_phasehash_slot(phase, len)]) != 0) {
+		i--;
+		if (osmtpd_phases[i].len == len &&
+		    memcmp(osmtpd_phases[i].name, phase, len) == 0)
+			return i;
+	}
+	osmtpd_errx(1, "Invalid line received: invalid phase: %s",
+	    osmtpd_linedup());
 }
 
 static const char *
@@ -1971,77 +3837,13 @@ osmtpd_typetostr(enum osmtpd_type type)
 static const char *
 osmtpd_phasetostr(enum osmtpd_phase phase)
 {
-	switch (phase) {
-	case OSMTPD_PHASE_CONNECT:
-		return "connect";
-	case OSMTPD_PHASE_HELO:
-		return "helo";
-	case OSMTPD_PHASE_EHLO:
-		return "ehlo";
-	case OSMTPD_PHASE_STARTTLS:
-		return "starttls";
-	case OSMTPD_PHASE_AUTH:
-		return "auth";
-	case OSMTPD_PHASE_MAIL_FROM:
-		return "mail-from";
-	case OSMTPD_PHASE_RCPT_TO:
-		return "rcpt-to";
-	case OSMTPD_PHASE_DATA:
-		return "data";
-	case OSMTPD_PHASE_DATA_LINE:
-		return "data-line";
-	case OSMTPD_PHASE_RSET:
-		return "rset";
-	case OSMTPD_PHASE_QUIT:
-		return "quit";
-	case OSMTPD_PHASE_NOOP:
-		return "noop";
-	case OSMTPD_PHASE_HELP:
-		return "help";
-	case OSMTPD_PHASE_WIZ:
-		return "wiz";
-	case OSMTPD_PHASE_COMMIT:
-		return "commit";
-	case OSMTPD_PHASE_LINK_AUTH:
-		return "link-auth";
-	case OSMTPD_PHASE_LINK_CONNECT:
-		return "link-connect";
-	case OSMTPD_PHASE_LINK_DISCONNECT:
-		return "link-disconnect";
-	case OSMTPD_PHASE_LINK_GREETING:
-		return "link-greeting";
-	case OSMTPD_PHASE_LINK_IDENTIFY:
-		return "link-identify";
-	case OSMTPD_PHASE_LINK_TLS:
-		return "link-tls";
-	case OSMTPD_PHASE_TX_BEGIN:
-		return "tx-begin";
-	case OSMTPD_PHASE_TX_MAIL:
-		return "tx-mail";
-	case OSMTPD_PHASE_TX_RCPT:
-		return "tx-rcpt";
-	case OSMTPD_PHASE_TX_ENVELOPE:
-		return "tx-envelope";
-	case OSMTPD_PHASE_TX_DATA:
-		return "tx-data";
-	case OSMTPD_PHASE_TX_COMMIT:
-		return "tx-commit";
-	case OSMTPD_PHASE_TX_ROLLBACK:
-		return "tx-rollback";
-	case OSMTPD_PHASE_PROTOCOL_CLIENT:
-		return "protocol-client";
-	case OSMTPD_PHASE_PROTOCOL_SERVER:
-		return "protocol-server";
-	case OSMTPD_PHASE_FILTER_RESPONSE:
-		return "filter-response";
-	case OSMTPD_PHASE_TIMEOUT:
-		return "timeout";
-	}
+	if ((size_t)phase < OSMTPD_NPHASES)
+		return osmtpd_phases[phase].name;
 	osmtpd_errx(1, "In valid phase: %d\n", phase);
 }
 
 static enum osmtpd_status
-osmtpd_strtostatus(const char *status, char *linedup)
+osmtpd_strtostatus(const char *status)
 {
 	if (strcmp(status, "ok") == 0)
 		return OSMTPD_STATUS_OK;
@@ -2049,12 +3851,12 @@ osmtpd_strtostatus(const char *status, char *linedup)
 		return OSMTPD_STATUS_TEMPFAIL;
 	else if (strcmp(status, "permfail") == 0)
 		return OSMTPD_STATUS_PERMFAIL;
-	osmtpd_errx(1, "Invalid line received: invalid status: %s\n", linedup);
+	osmtpd_errx(1, "Invalid line received: invalid status: %s\n",
+	    osmtpd_linedup());
 }
 
 static void
-osmtpd_addrtoss(char *addr, struct sockaddr_storage *ss, int hasport,
-    char *linedup)
+osmtpd_addrtoss(char *addr, struct sockaddr_storage *ss, int hasport)
 {
 	char *port = NULL;
 	const char *errstr = NULL;
@@ -2070,23 +3872,23 @@ osmtpd_addrtoss(char *addr, struct sockaddr_storage *ss, int hasport,
 		if (hasport) {
 			if ((port = strrchr(addr, ':')) == NULL)
 				osmtpd_errx(1, "Invalid line received: invalid "
-				    "address (%s): %s", addr, linedup);
+				    "address (%s): %s", addr, osmtpd_linedup());
 			if (port[-1] != ']')
 				osmtpd_errx(1, "Invalid line received: invalid "
-				    "address (%s): %s", addr, linedup);
+				    "address (%s): %s", addr, osmtpd_linedup());
 			port++;
 			sin6->sin6_port = htons(strtonum(port, 0, UINT16_MAX,
 			    &errstr));
 			if (errstr != NULL)
 				osmtpd_errx(1, "Invalid line received: invalid "
-				    "address (%s): %s", addr, linedup);
-			port[-2] = '\0';
+				    "address (%s): %s", addr, osmtpd_linedup());
+			osmtpd_cut(port - 2);
 		} else {
 			n = strlen(addr);
 			if (addr[n - 1] != ']')
 				osmtpd_errx(1, "Invalid line received: invalid "
-				    "address (%s): %s", addr, linedup);
-			addr[n - 1] = '\0';
+				    "address (%s): %s", addr, osmtpd_linedup());
+			osmtpd_cut(addr + n - 1);
 		}
 		switch (inet_pton(AF_INET6, addr + 1, &(sin6->sin6_addr))) {
 		case 1:
@@ -2097,14 +3899,14 @@ osmtpd_addrtoss(char *addr, struct sockaddr_storage *ss, int hasport,
 			else
 				addr[n - 1] = ']';
 			osmtpd_errx(1, "Invalid line received: invalid address "
-			    "(%s): %s", addr, linedup);
+			    "(%s): %s", addr, osmtpd_linedup());
 		default:
 			if (hasport)
 				port[-2] = ']';
 			else
 				addr[n - 1] = ']';
 			osmtpd_err(1, "Can't parse address (%s): %s", addr,
-			    linedup);
+			    osmtpd_linedup());
 		}
 	} else if (strncasecmp(addr, "unix:", 5) == 0) {
 		sun = (struct sockaddr_un *)ss;
@@ -2112,7 +3914,7 @@ osmtpd_addrtoss(char *addr, struct sockaddr_storage *ss, int hasport,
 		if (strlcpy(sun->sun_path, addr,
 		    sizeof(sun->sun_path)) >= sizeof(sun->sun_path)) {
 			osmtpd_errx(1, "Invalid line received: address too "
-			    "long (%s): %s", addr, linedup);
+			    "long (%s): %s", addr, osmtpd_linedup());
 		}
 	} else {
 		sin = (struct sockaddr_in *)ss;
@@ -2121,14 +3923,14 @@ osmtpd_addrtoss(char *addr, struct sockaddr_storage *ss, int hasport,
 		if (hasport) {
 			if ((port = strrchr(addr, ':')) == NULL)
 				osmtpd_errx(1, "Invalid line received: invalid "
-				    "address (%s): %s", addr, linedup);
+				    "address (%s): %s", addr, osmtpd_linedup());
 			port++;
 			sin->sin_port = htons(strtonum(port, 0, UINT16_MAX,
 			    &errstr));
 			if (errstr != NULL)
 				osmtpd_errx(1, "Invalid line received: invalid "
-				    "address (%s): %s", addr, linedup);
-			port[-1] = '\0';
+				    "address (%s): %s", addr, osmtpd_linedup());
+			osmtpd_cut(port - 1);
 		}
 		switch (inet_pton(AF_INET, addr, &(sin->sin_addr))) {
 		case 1:
@@ -2137,20 +3939,130 @@ osmtpd_addrtoss(char *addr, struct sockaddr_storage *ss, int hasport,
 			if (hasport)
 				port[-1] = ':';
 			osmtpd_errx(1, "Invalid line received: invalid address "
-			    "(%s): %s", addr, linedup);
+			    "(%s): %s", addr, osmtpd_linedup());
 		default:
 			if (hasport)
 				port[-1] = ':';
 			osmtpd_err(1, "Can't parse address (%s): %s", addr,
-			    linedup);
+			    osmtpd_linedup());
 		}
 	}
 }
 
-static int
-osmtpd_session_cmp(struct osmtpd_session *a, struct osmtpd_session *b)
+/* Fibonacci hashing, reqids are sequential in their upper bits */
+static size_t
+osmtpd_session_slot(uint64_t reqid)
+{
+	return (reqid * UINT64_C(0x9e3779b97f4a7c15)) >> sessionsshift;
+}
+
+/* Distance of the entry in slot i from the slot it hashes to */
+static size_t
+osmtpd_session_dist(size_t i)
+{
+	return (i - osmtpd_session_slot(sessions[i].reqid)) & sessionsmask;
+}
+
+static size_t
+osmtpd_session_lookup(uint64_t reqid)
+{
+	size_t i, dist;
+
+	if (nsessions == 0)
+		return SIZE_MAX;
+	i = osmtpd_session_slot(reqid);
+	for (dist = 0;; dist++, i = (i + 1) & sessionsmask) {
+		if (sessions[i].session == NULL ||
+		    osmtpd_session_dist(i) < dist)
+			return SIZE_MAX;
+		if (sessions[i].reqid == reqid)
+			return i;
+	}
+}
+
+static struct osmtpd_session *
+osmtpd_session_find(uint64_t reqid)
+{
+	size_t i;
+
+	if (lastsession != NULL && lastsession->ctx.reqid == reqid)
+		return lastsession;
+	if ((i = osmtpd_session_lookup(reqid)) == SIZE_MAX)
+		return NULL;
+	return lastsession = sessions[i].session;
+}
+
+static void
+osmtpd_session_place(struct osmtpd_sessionslot slot)
 {
-	return a->ctx.reqid < b->ctx.reqid ? -1 : a->ctx.reqid > b->ctx.reqid;
+	struct osmtpd_sessionslot tmp;
+	size_t i, dist, sdist;
+
+	i = osmtpd_session_slot(slot.reqid);
+	for (dist = 0;; dist++, i = (i + 1) & sessionsmask) {
+		if (sessions[i].session == NULL) {
+			sessions[i] = slot;
+			return;
+		}
+		/* Take the place of entries closer to their home slot */
+		if ((sdist = osmtpd_session_dist(i)) < dist) {
+			tmp = sessions[i];
+			sessions[i] = slot;
+			slot = tmp;
+			dist = sdist;
+		}
+	}
 }
 
-RB_GENERATE_STATIC(osmtpd_sessions, osmtpd_session, entry, osmtpd_session_cmp);
+static void
+osmtpd_session_insert(struct osmtpd_session *session)
+{
+	struct osmtpd_sessionslot slot, *old;
+	size_t i, oldsize, size;
+
+	oldsize = sessions == NULL ? 0 : sessionsmask + 1;
+	/* Keep the load factor below 7/8 */
+	if (nsessions + 1 > oldsize - oldsize / 8) {
+		size = oldsize == 0 ? 64 : oldsize * 2;
+		old = sessions;
+		if ((sessions = calloc(size, sizeof(*sessions))) == NULL)
+			osmtpd_err(1, NULL);
+		sessionsmask = size - 1;
+		for (sessionsshift = 64; size > 1; size >>= 1)
+			sessionsshift--;
+		for (i = 0; i < oldsize; i++) {
+			if (old[i].session != NULL)
+				osmtpd_session_place(old[i]);
+		}
+		free(old);
+	}
+	slot.reqid = session->ctx.reqid;
+	slot.session = session;
+	osmtpd_session_place(slot);
+	nsessions++;
+	lastsession = session;
+}
+
+static struct osmtpd_session *
+osmtpd_session_remove(uint64_t reqid)
+{
+	struct osmtpd_session *session;
+	size_t i, next;
+
+	if ((i = osmtpd_session_lookup(reqid)) == SIZE_MAX)
+		return NULL;
+	session = sessions[i].session;
+	/* Shift the following entries back, so no tombstones are needed */
+	for (;; i = next) {
+		next = (i + 1) & sessionsmask;
+		if (sessions[next].session == NULL ||
+		    osmtpd_session_dist(next) == 0)
+			break;
+		sessions[i] = sessions[next];
+	}
+	sessions[i].session = NULL;
+	nsessions--;
+	if (lastsession == session)
+		lastsession = NULL;
+	return session;
+}
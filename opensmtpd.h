@@ -15,6 +15,11 @@
  */
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+struct event;
+struct event_base;
+struct timeval;
 
 #ifndef __dead
 #define __dead __attribute__((__noreturn__))
@@ -87,6 +92,9 @@ enum osmtpd_auth_result {
 #define OSMTPD_NEED_RCPTTO 1 << 9
 #define OSMTPD_NEED_EVPID 1 << 10
 
+#define OSMTPD_MEMLIMIT_TEMPFAIL 0
+#define OSMTPD_MEMLIMIT_EVICT 1
+
 struct osmtpd_ctx {
 	enum osmtpd_type	 type;
 	enum osmtpd_phase	 phase;
@@ -98,15 +106,15 @@ struct osmtpd_ctx {
 	uint64_t		 token;
 	struct sockaddr_storage	 src;
 	struct sockaddr_storage	 dst;
-	char			*rdns;
+	const char		*rdns;
 	enum osmtpd_status	 fcrdns;
 	/* HELO/EHLO identity */
-	char			*identity;
+	const char		*identity;
 	struct greeting {
-		char			*identity;
+		const char		*identity;
 		/* textstring not supplied by smtpd */
 	}			 greeting;
-	char			*ciphers;
+	const char		*ciphers;
 	uint32_t		 msgid;
 	char			*mailfrom;
 	char			**rcptto;
@@ -115,6 +123,42 @@ struct osmtpd_ctx {
 	void			*local_message;
 };
 
+/* Counters kept by the library, see osmtpd_metrics */
+struct osmtpd_metrics {
+	size_t		 sessions;
+	uint64_t	 sessions_evicted;
+	size_t		 memory;
+	uint64_t	 sessions_refused;
+	uint64_t	 sessions_reclaimed;
+	uint64_t	 outq_allocated;
+	uint64_t	 outq_reused;
+	size_t		 output_queued;
+	int		 input_paused;
+	uint64_t	 input_pauses;
+	uint64_t	 defers_expired;
+	uint64_t	 defers_late;
+	size_t		 offload_pending;
+	uint64_t	 input_reads;
+	uint64_t	 input_rearms;
+	uint64_t	 output_writes;
+	uint64_t	 output_rearms;
+};
+
+/* A report event as delivered to the osmtpd_register_batch callback */
+struct osmtpd_event {
+	struct osmtpd_ctx	*ctx;
+	enum osmtpd_phase	 phase;
+	int			 incoming;
+	struct timespec		 tm;
+	/* Event arguments, which ones are set depends on phase */
+	const char		*str;
+	enum osmtpd_status	 status;
+	enum osmtpd_auth_result	 auth;
+	uint32_t		 msgid;
+	uint64_t		 evpid;
+	size_t			 msgsz;
+};
+
 void osmtpd_register_conf(void (*)(const char *, const char *));
 void osmtpd_register_filter_connect(void (*)(struct osmtpd_ctx *, const char *,
     struct sockaddr_storage *));
@@ -128,6 +172,8 @@ void osmtpd_register_filter_rcptto(void (*)(struct osmtpd_ctx *, const char *));
 void osmtpd_register_filter_data(void (*)(struct osmtpd_ctx *));
 void osmtpd_register_filter_dataline(void (*)(struct osmtpd_ctx *,
     const char *));
+void osmtpd_register_filter_dataline_part(void (*)(struct osmtpd_ctx *,
+    const char *, size_t, int));
 void osmtpd_register_filter_rset(void (*)(struct osmtpd_ctx *));
 void osmtpd_register_filter_quit(void (*)(struct osmtpd_ctx *));
 void osmtpd_register_filter_noop(void (*)(struct osmtpd_ctx *));
@@ -166,12 +212,30 @@ void osmtpd_register_report_response(int, void (*)(struct osmtpd_ctx *,
 void osmtpd_register_report_timeout(int, void (*)(struct osmtpd_ctx *));
 void osmtpd_register_report_auth(int, void (*)(struct osmtpd_ctx *,
     const char *, enum osmtpd_auth_result));
+void osmtpd_register_report_batch(int, enum osmtpd_phase);
+void osmtpd_register_batch(void (*)(struct osmtpd_event *, size_t));
 void osmtpd_local_session(void *(*)(struct osmtpd_ctx *),
     void (*)(struct osmtpd_ctx *, void *));
 void osmtpd_local_message(void *(*)(struct osmtpd_ctx *),
     void (*)(struct osmtpd_ctx *, void *));
 void osmtpd_need(int);
+const char *osmtpd_intern(const char *);
+void osmtpd_intern_release(const char *);
+void osmtpd_memlimit(size_t, int);
+void osmtpd_outq(size_t, size_t);
+void osmtpd_outwat(size_t, size_t);
+void osmtpd_inbuf(size_t, size_t);
+const struct osmtpd_metrics *osmtpd_metrics(void);
+size_t osmtpd_rcpt_count(struct osmtpd_ctx *);
+const char *osmtpd_rcpt_at(struct osmtpd_ctx *, size_t);
+enum osmtpd_status osmtpd_rcpt_status(struct osmtpd_ctx *, size_t);
 
+uint64_t osmtpd_defer(struct osmtpd_ctx *, int, enum osmtpd_status);
+int osmtpd_defer_resume(struct osmtpd_ctx *, uint64_t);
+void osmtpd_offload_threads(int);
+void osmtpd_workers(int);
+void osmtpd_offload(struct osmtpd_ctx *, void (*)(void *),
+    void (*)(struct osmtpd_ctx *, void *), void *);
 void osmtpd_filter_proceed(struct osmtpd_ctx *);
 void osmtpd_filter_reject(struct osmtpd_ctx *, int, const char *, ...)
 	__attribute__((__format__ (printf, 3, 4)));
@@ -187,6 +251,18 @@ void osmtpd_filter_rewrite(struct osmtpd_ctx *, const char *, ...)
 	__attribute__((__format__ (printf, 2, 3)));
 void osmtpd_filter_dataline(struct osmtpd_ctx *, const char *, ...)
 	__attribute__((__format__ (printf, 2, 3)));
+void osmtpd_filter_dataline_raw(struct osmtpd_ctx *, const char *, size_t);
+void osmtpd_filter_dataline_iov(struct osmtpd_ctx *, const struct iovec *,
+    int);
+void osmtpd_filter_dataline_part(struct osmtpd_ctx *, const char *, size_t,
+    int);
+void osmtpd_filter_message(struct osmtpd_ctx *, const char *, size_t);
+void osmtpd_filter_message_iov(struct osmtpd_ctx *, const struct iovec *, int);
+struct event_base *osmtpd_event_base(void);
+void osmtpd_add_fd(struct event *, int, short, void (*)(int, short, void *),
+    void *);
+void osmtpd_add_timer(struct event *, const struct timeval *,
+    void (*)(int, short, void *), void *);
 void osmtpd_run(void);
 __dead void osmtpd_err(int eval, const char *fmt, ...);
 __dead void osmtpd_errx(int eval, const char *fmt, ...);